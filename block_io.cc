@@ -0,0 +1,192 @@
+#include <cstring>
+#include "zlib.h"
+
+#include "block_io.h"
+
+using namespace std;
+
+void put_varint(ByteBuffer& buf, uint64_t v){
+    while(v >= 0x80){
+        buf.push_back(static_cast<unsigned char>(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back(static_cast<unsigned char>(v));
+}
+
+bool get_varint(const ByteBuffer& buf, size_t& offset, uint64_t& v){
+    v = 0;
+    for(int shift = 0; shift < 64 && offset < buf.size(); shift += 7){
+        unsigned char b = buf[offset++];
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if( (b & 0x80) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+//Files are always little-endian
+void put_uint32(ostream& out, uint32_t v){
+    unsigned char b[4];
+    for(int i = 0; i < 4; i++){
+        b[i] = (v >> (8*i)) & 0xff;
+    }
+    out.write(reinterpret_cast<char*>(b), 4);
+}
+
+void put_uint64(ostream& out, uint64_t v){
+    unsigned char b[8];
+    for(int i = 0; i < 8; i++){
+        b[i] = (v >> (8*i)) & 0xff;
+    }
+    out.write(reinterpret_cast<char*>(b), 8);
+}
+
+bool get_uint32(istream& in, uint32_t& v){
+    unsigned char b[4];
+    if(!in.read(reinterpret_cast<char*>(b), 4)){
+        return false;
+    }
+    v = 0;
+    for(int i = 0; i < 4; i++){
+        v |= static_cast<uint32_t>(b[i]) << (8*i);
+    }
+    return true;
+}
+
+bool get_uint64(istream& in, uint64_t& v){
+    unsigned char b[8];
+    if(!in.read(reinterpret_cast<char*>(b), 8)){
+        return false;
+    }
+    v = 0;
+    for(int i = 0; i < 8; i++){
+        v |= static_cast<uint64_t>(b[i]) << (8*i);
+    }
+    return true;
+}
+
+void put_string(ostream& out, const string& s){
+    put_uint32(out, s.size());
+    out.write(s.data(), s.size());
+}
+
+bool get_string(istream& in, string& s){
+    uint32_t n;
+    if(!get_uint32(in, n)){
+        return false;
+    }
+    s.resize(n);
+    return n == 0 || in.read(&s[0], n);
+}
+
+void put_shuffled_doubles(ByteBuffer& buf, const vector<double>& values){
+    size_t n = values.size();
+    size_t start = buf.size();
+    buf.resize(start + n * 8);
+    for(size_t i = 0; i < n; i++){
+        uint64_t bits;
+        memcpy(&bits, &values[i], 8);
+        for(size_t b = 0; b < 8; b++){
+            buf[start + b*n + i] = (bits >> (8*b)) & 0xff;
+        }
+    }
+}
+
+bool get_shuffled_doubles(const ByteBuffer& buf, size_t& offset, size_t n, vector<double>& values){
+    if(offset + n*8 > buf.size()){
+        return false;
+    }
+    values.resize(n);
+    for(size_t i = 0; i < n; i++){
+        uint64_t bits = 0;
+        for(size_t b = 0; b < 8; b++){
+            bits |= static_cast<uint64_t>(buf[offset + b*n + i]) << (8*b);
+        }
+        memcpy(&values[i], &bits, 8);
+    }
+    offset += n*8;
+    return true;
+}
+
+uint64_t write_block(ostream& out, const ByteBuffer& raw){
+    uLongf packed_len = compressBound(raw.size());
+    ByteBuffer packed(packed_len);
+    compress2(packed.data(), &packed_len, raw.data(), raw.size(), Z_DEFAULT_COMPRESSION);
+    put_uint32(out, raw.size());
+    put_uint32(out, packed_len);
+    out.write(reinterpret_cast<const char*>(packed.data()), packed_len);
+    return 8 + packed_len;
+}
+
+bool read_block(istream& in, ByteBuffer& raw){
+    uint32_t raw_len, packed_len;
+    if(!get_uint32(in, raw_len) || !get_uint32(in, packed_len)){
+        return false;
+    }
+    ByteBuffer packed(packed_len);
+    if(!in.read(reinterpret_cast<char*>(packed.data()), packed_len)){
+        return false;
+    }
+    raw.resize(raw_len);
+    uLongf out_len = raw_len;
+    if(uncompress(raw.data(), &out_len, packed.data(), packed_len) != Z_OK){
+        return false;
+    }
+    return out_len == raw_len;
+}
+
+void write_block_index(ostream& out, uint64_t index_offset, const vector<string>& contigs,
+                       const vector<BlockInfo>& index, const char magic[8]){
+    put_uint32(out, contigs.size());
+    for(auto& c: contigs){
+        put_string(out, c);
+    }
+    put_uint64(out, index.size());
+    for(auto& b: index){
+        put_uint32(out, b.contig);
+        put_uint32(out, b.nsites);
+        put_uint64(out, b.first_pos);
+        put_uint64(out, b.last_pos);
+        put_uint64(out, b.offset);
+    }
+    put_uint64(out, index_offset);
+    out.write(magic, 8);
+}
+
+bool read_block_index(istream& in, vector<string>& contigs, vector<BlockInfo>& index,
+                      const char magic[8]){
+    in.seekg(-16, ios::end);
+    uint64_t index_offset;
+    char m[8];
+    if(!get_uint64(in, index_offset) || !in.read(m, 8) || memcmp(m, magic, 8) != 0){
+        return false;
+    }
+    in.seekg(index_offset);
+    //entries are read one at a time, so a corrupt count can't make us
+    //allocate more than the file holds
+    uint32_t ncontigs;
+    get_uint32(in, ncontigs);
+    contigs.clear();
+    for(uint32_t i = 0; in && i < ncontigs; i++){
+        string c;
+        get_string(in, c);
+        contigs.push_back(c);
+    }
+    uint64_t nblocks;
+    get_uint64(in, nblocks);
+    index.clear();
+    for(uint64_t i = 0; in && i < nblocks; i++){
+        BlockInfo b;
+        get_uint32(in, b.contig);
+        get_uint32(in, b.nsites);
+        get_uint64(in, b.first_pos);
+        get_uint64(in, b.last_pos);
+        get_uint64(in, b.offset);
+        if(b.contig >= contigs.size()){
+            return false;
+        }
+        index.push_back(b);
+    }
+    return static_cast<bool>(in);
+}
@@ -0,0 +1,54 @@
+#ifndef block_io_H
+#define block_io_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+// Small helpers shared by the binary output formats. Columns are appended to
+// a byte buffer, then each block is deflated and written with its sizes
+// in front so a reader can skip blocks it doesn't need.
+
+typedef vector<unsigned char> ByteBuffer;
+
+void put_varint(ByteBuffer& buf, uint64_t v);
+bool get_varint(const ByteBuffer& buf, size_t& offset, uint64_t& v);
+
+void put_uint32(ostream& out, uint32_t v);
+void put_uint64(ostream& out, uint64_t v);
+bool get_uint32(istream& in, uint32_t& v);
+bool get_uint64(istream& in, uint64_t& v);
+
+void put_string(ostream& out, const string& s);
+bool get_string(istream& in, string& s);
+
+// Store doubles with their bytes transposed (all first bytes, then all
+// second bytes...). Posteriors share exponents and leading mantissa bits, so
+// the shuffled column deflates much better than the raw one.
+void put_shuffled_doubles(ByteBuffer& buf, const vector<double>& values);
+bool get_shuffled_doubles(const ByteBuffer& buf, size_t& offset, size_t n, vector<double>& values);
+
+// Returns the number of bytes written
+uint64_t write_block(ostream& out, const ByteBuffer& raw);
+bool read_block(istream& in, ByteBuffer& raw);
+
+// Where to find a block of records from one contig
+struct BlockInfo{
+    uint32_t contig;
+    uint32_t nsites;
+    uint64_t first_pos;
+    uint64_t last_pos;
+    uint64_t offset;
+};
+
+// Block files end with the contig names and block index, then the offset
+// they start at and an 8-byte magic, so readers can find them from the end
+void write_block_index(ostream& out, uint64_t index_offset, const vector<string>& contigs,
+                       const vector<BlockInfo>& index, const char magic[8]);
+bool read_block_index(istream& in, vector<string>& contigs, vector<BlockInfo>& index,
+                      const char magic[8]);
+
+#endif
@@ -0,0 +1,237 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+#include "count_file.h"
+
+using namespace std;
+
+static const char COUNT_MAGIC[8] = {'A','C','M','C','N','T','S','1'};
+static const char COUNT_INDEX_MAGIC[8] = {'A','C','M','C','I','D','X','1'};
+
+CountWriter::CountWriter(string file_name, const vector<string>& sample_names, bool strand_split):
+    m_out(file_name, ios::binary), m_offset(0),
+    m_ncounts(sample_names.size() * (strand_split ? 8 : 4)),
+    m_in_run(false), m_run_contig(0), m_run_pos(0), m_run_length(0), m_run_ref('N'),
+    m_block_contig(0), m_block_sites(0), m_block_first(0), m_block_last(0),
+    m_closed(false){
+    m_out.write(COUNT_MAGIC, 8);
+    put_uint32(m_out, strand_split ? 1 : 0);
+    put_uint32(m_out, sample_names.size());
+    m_offset += 16;
+    for(auto& s: sample_names){
+        put_string(m_out, s);
+        m_offset += 4 + s.size();
+    }
+}
+
+CountWriter::~CountWriter(){
+    close();
+}
+
+void CountWriter::add(const string& chr, uint64_t pos, char ref_base, const uint16_t* counts){
+    auto it = m_contig_ids.find(chr);
+    uint32_t contig;
+    if(it == m_contig_ids.end()){
+        contig = m_contigs.size();
+        m_contig_ids[chr] = contig;
+        m_contigs.push_back(chr);
+    }
+    else{
+        contig = it->second;
+    }
+    //Invariant stretches (same base, same counts) just extend the run
+    if(m_in_run && contig == m_run_contig && pos == m_run_pos + m_run_length &&
+       ref_base == m_run_ref && equal(counts, counts + m_ncounts, m_run_counts.begin())){
+        m_run_length++;
+        return;
+    }
+    end_run();
+    m_in_run = true;
+    m_run_contig = contig;
+    m_run_pos = pos;
+    m_run_length = 1;
+    m_run_ref = ref_base;
+    m_run_counts.assign(counts, counts + m_ncounts);
+}
+
+void CountWriter::end_run(){
+    if(!m_in_run){
+        return;
+    }
+    //Blocks never span contigs, and positions must increase within a block
+    if(m_block_sites > 0 && (m_run_contig != m_block_contig || m_run_pos <= m_block_last ||
+                             m_block_sites + m_run_length > COUNT_BLOCK_SIZE)){
+        flush_block();
+    }
+    if(m_block_sites == 0){
+        m_block_contig = m_run_contig;
+        m_block_first = m_run_pos;
+        m_block_last = m_run_pos;
+    }
+    put_varint(m_block, m_run_pos - m_block_last);
+    put_varint(m_block, m_run_length);
+    m_block.push_back(m_run_ref);
+    for(auto c: m_run_counts){
+        put_varint(m_block, c);
+    }
+    m_block_sites += m_run_length;
+    m_block_last = m_run_pos + m_run_length - 1;
+    m_in_run = false;
+}
+
+void CountWriter::flush_block(){
+    if(m_block_sites == 0){
+        return;
+    }
+    m_index.push_back(BlockInfo{ m_block_contig, m_block_sites, m_block_first,
+                                 m_block_last, m_offset });
+    m_offset += write_block(m_out, m_block);
+    m_block.clear();
+    m_block_sites = 0;
+}
+
+void CountWriter::close(){
+    if(m_closed){
+        return;
+    }
+    end_run();
+    flush_block();
+    write_block_index(m_out, m_offset, m_contigs, m_index, COUNT_INDEX_MAGIC);
+    m_out.close();
+    m_closed = true;
+}
+
+
+CountReader::CountReader(string file_name):
+    m_in(file_name, ios::binary), m_good(false), m_strand_split(false), m_ncounts(0),
+    m_block(0), m_region_contig(-1), m_start(0), m_end(0), m_raw_offset(0),
+    m_current_contig(0), m_pos(0), m_run_left(0), m_run_ref('N'){
+    char magic[8];
+    if(!m_in.read(magic, 8) || memcmp(magic, COUNT_MAGIC, 8) != 0){
+        cerr << "Error: " << file_name << " is not an accuMUlate count file" << endl;
+        return;
+    }
+    uint32_t flags, nsamples;
+    get_uint32(m_in, flags);
+    get_uint32(m_in, nsamples);
+    m_strand_split = flags & 1;
+    m_samples.resize(nsamples);
+    for(auto& s: m_samples){
+        get_string(m_in, s);
+    }
+    m_ncounts = nsamples * (m_strand_split ? 8 : 4);
+    if(!m_in || !read_block_index(m_in, m_contigs, m_index, COUNT_INDEX_MAGIC)){
+        cerr << "Error: " << file_name << " has no block index (truncated?)" << endl;
+        return;
+    }
+    m_good = true;
+    clear_region();
+}
+
+void CountReader::clear_region(){
+    m_region_contig = -1;
+    m_start = 0;
+    m_end = UINT64_MAX;
+    m_block = 0;
+    m_raw.clear();
+    m_raw_offset = 0;
+    m_run_left = 0;
+}
+
+bool CountReader::set_region(const string& chr, uint64_t start, uint64_t end){
+    clear_region();
+    auto it = find(m_contigs.begin(), m_contigs.end(), chr);
+    if(it == m_contigs.end()){
+        m_block = m_index.size();
+        return false;
+    }
+    m_region_contig = distance(m_contigs.begin(), it);
+    m_start = start;
+    m_end = end;
+    return true;
+}
+
+bool CountReader::block_in_region(const BlockInfo& b) const{
+    if(m_region_contig < 0){
+        return true;
+    }
+    return b.contig == static_cast<uint32_t>(m_region_contig) &&
+           b.last_pos >= m_start && b.first_pos < m_end;
+}
+
+bool CountReader::load_block(size_t block){
+    const BlockInfo& b = m_index[block];
+    m_in.clear();
+    m_in.seekg(b.offset);
+    if(!read_block(m_in, m_raw)){
+        cerr << "Error: corrupt block in count file" << endl;
+        return false;
+    }
+    m_raw_offset = 0;
+    m_current_contig = b.contig;
+    m_pos = b.first_pos;
+    return true;
+}
+
+bool CountReader::next(CountRecord& record){
+    if(!m_good){
+        return false;
+    }
+    while(true){
+        if(m_run_left == 0){
+            if(m_raw_offset >= m_raw.size()){
+                //find the next block that overlaps the region
+                while(m_block < m_index.size() && !block_in_region(m_index[m_block])){
+                    m_block++;
+                }
+                if(m_block >= m_index.size()){
+                    return false;
+                }
+                if(!load_block(m_block)){
+                    m_good = false;
+                    return false;
+                }
+                m_block++;
+            }
+            uint64_t gap, run;
+            bool ok = get_varint(m_raw, m_raw_offset, gap) && get_varint(m_raw, m_raw_offset, run) &&
+                      run > 0 && m_raw_offset < m_raw.size();
+            if(ok){
+                m_pos += gap;
+                m_run_left = run;
+                m_run_ref = m_raw[m_raw_offset++];
+                m_run_counts.resize(m_ncounts);
+                for(auto& c: m_run_counts){
+                    uint64_t v;
+                    ok = ok && get_varint(m_raw, m_raw_offset, v) && v <= UINT16_MAX;
+                    c = v;
+                }
+            }
+            if(!ok){
+                cerr << "Error: corrupt block in count file" << endl;
+                m_good = false;
+                return false;
+            }
+        }
+        else{
+            m_pos++;
+        }
+        m_run_left--;
+        if(m_pos < m_start || m_pos >= m_end){
+            continue;
+        }
+        record.contig = m_current_contig;
+        record.chr = m_contigs[m_current_contig];
+        record.pos = m_pos;
+        record.ref_base = m_run_ref;
+        record.counts = m_run_counts;
+        return true;
+    }
+}
+
+bool is_count_file(const string& file_name){
+    ifstream in(file_name, ios::binary);
+    char magic[8];
+    return in.read(magic, 8) && memcmp(magic, COUNT_MAGIC, 8) == 0;
+}
@@ -0,0 +1,106 @@
+#ifndef count_file_H
+#define count_file_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+
+#include "block_io.h"
+
+using namespace std;
+
+// Per-site, per-sample base counts (what the model needs from the BAMs),
+// written by `accuMUlate count` and read by `accuMUlate call`. Each record is
+// a run of consecutive positions with the same reference base and the same
+// counts: varint position gap, run length, reference base, then every count
+// as a varint. Counts are per sample ACGT, or with strand-split files all the
+// forward-strand counts followed by all the reverse ones. Records are
+// deflated in blocks of (at most) COUNT_BLOCK_SIZE positions from one contig,
+// indexed at the end of the file like the binary site output.
+
+const uint32_t COUNT_BLOCK_SIZE = 16384;
+
+struct CountRecord{
+    string chr;
+    uint32_t contig;
+    uint64_t pos;
+    char ref_base;
+    vector<uint16_t> counts;
+};
+
+class CountWriter{
+    public:
+        CountWriter(string file_name, const vector<string>& sample_names, bool strand_split);
+        ~CountWriter();
+        size_t ncounts() const { return m_ncounts; }
+        bool good() const { return m_out.good(); }
+        // counts holds ncounts() values, laid out as described above
+        void add(const string& chr, uint64_t pos, char ref_base, const uint16_t* counts);
+        void close();
+    private:
+        void end_run();
+        void flush_block();
+        ofstream m_out;
+        uint64_t m_offset;
+        size_t m_ncounts;
+        vector<string> m_contigs;
+        unordered_map<string, uint32_t> m_contig_ids;
+        vector<BlockInfo> m_index;
+        // the run being extended
+        bool m_in_run;
+        uint32_t m_run_contig;
+        uint64_t m_run_pos;
+        uint64_t m_run_length;
+        char m_run_ref;
+        vector<uint16_t> m_run_counts;
+        // the block being filled
+        ByteBuffer m_block;
+        uint32_t m_block_contig;
+        uint32_t m_block_sites;
+        uint64_t m_block_first;
+        uint64_t m_block_last;
+        bool m_closed;
+};
+
+class CountReader{
+    public:
+        CountReader(string file_name);
+        bool good() const { return m_good; }
+        const vector<string>& contigs() const { return m_contigs; }
+        const vector<string>& sample_names() const { return m_samples; }
+        bool strand_split() const { return m_strand_split; }
+        size_t ncounts() const { return m_ncounts; }
+        // Restrict iteration to [start, end) on chr. Returns false if chr
+        // isn't in the file
+        bool set_region(const string& chr, uint64_t start, uint64_t end);
+        void clear_region();
+        bool next(CountRecord& record);
+    private:
+        bool load_block(size_t block);
+        bool block_in_region(const BlockInfo& b) const;
+        ifstream m_in;
+        bool m_good;
+        vector<string> m_samples;
+        bool m_strand_split;
+        size_t m_ncounts;
+        vector<string> m_contigs;
+        vector<BlockInfo> m_index;
+        size_t m_block;
+        int64_t m_region_contig;
+        uint64_t m_start;
+        uint64_t m_end;
+        // decoded block, and where we are in it
+        ByteBuffer m_raw;
+        size_t m_raw_offset;
+        uint32_t m_current_contig;
+        uint64_t m_pos;
+        uint64_t m_run_left;
+        char m_run_ref;
+        vector<uint16_t> m_run_counts;
+};
+
+bool is_count_file(const string& file_name);
+
+#endif
@@ -0,0 +1,68 @@
+#include <algorithm>
+
+#include "depth_filter.h"
+
+using namespace std;
+using namespace BamTools;
+
+DepthFilter::DepthFilter(const SampleSet& samples, uint32_t max_depth, bool flag_sites):
+    m_samples(samples), m_max_depth(max_depth), m_active(samples.size()),
+    m_active_ref(-1), m_active_pos(-1), m_pending_ref(-1), m_pending_pos(-1),
+    m_flag_sites(flag_sites), m_dropped(0) { }
+
+vector<bool>& DepthFilter::choose(){
+    //a new contig, or a new region starting further back
+    if(m_pending_ref != m_active_ref || m_pending_pos < m_active_pos){
+        for(auto& a: m_active){
+            a = EndHeap();
+        }
+    }
+    m_active_ref = m_pending_ref;
+    m_active_pos = m_pending_pos;
+    for(auto& a: m_active){
+        while(!a.empty() && a.top() <= m_pending_pos){
+            a.pop();
+        }
+    }
+
+    m_ranked.clear();
+    for(size_t i = 0; i < m_pending.size(); i++){
+        m_ranked.push_back(Ranked{ m_samples.index(m_pending[i]),
+                                   read_name_hash(m_pending[i]), i });
+    }
+    sort(m_ranked.begin(), m_ranked.end());
+    m_kept.assign(m_pending.size(), true);
+    for(auto& r: m_ranked){
+        if(r.sample < 0){
+            continue;
+        }
+        int32_t end = m_pending[r.index].GetEndPosition();
+        EndHeap& active = m_active[r.sample];
+        if(active.size() < m_max_depth){
+            active.push(end);
+            continue;
+        }
+        m_kept[r.index] = false;
+        m_dropped++;
+        if(!m_flag_sites){
+            continue;
+        }
+        if(!m_capped.empty() && m_capped.back().ref_id == m_pending_ref &&
+           m_capped.back().end >= m_pending_pos){
+            m_capped.back().end = max(m_capped.back().end, end);
+        }
+        else{
+            m_capped.push_back(Interval{ m_pending_ref, m_pending_pos, end });
+        }
+    }
+    return m_kept;
+}
+
+bool DepthFilter::capped(int32_t ref_id, int32_t pos){
+    while(!m_capped.empty() && (m_capped.front().ref_id < ref_id ||
+                                (m_capped.front().ref_id == ref_id && m_capped.front().end <= pos))){
+        m_capped.pop_front();
+    }
+    return !m_capped.empty() && m_capped.front().ref_id == ref_id &&
+           m_capped.front().start <= pos;
+}
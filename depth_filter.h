@@ -0,0 +1,96 @@
+#ifndef depth_filter_H
+#define depth_filter_H
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <functional>
+
+#include "api/BamAlignment.h"
+#include "parsers.h"
+
+using namespace std;
+
+//--max-depth: caps the number of reads per sample covering any position,
+//dropping reads before they reach the pileup so the pileup window and the
+//per-site model cost stay bounded. Reads come in position order; those that
+//start at the same position are taken in order of a hash of their name, so
+//which reads are kept doesn't depend on the order of the input files, and
+//both mates of a pair rank the same. With flag_sites, positions covered by a
+//dropped read are remembered so sites can be flagged as capped; capped() has
+//to be asked about every site then, or they pile up.
+class DepthFilter{
+    public:
+        DepthFilter(const SampleSet& samples, uint32_t max_depth, bool flag_sites);
+
+        //Kept reads are passed on to keep(), in position order
+        template<typename F>
+        void add(const BamTools::BamAlignment& ali, F keep){
+            if(!m_pending.empty() && (ali.RefID != m_pending_ref || ali.Position != m_pending_pos)){
+                release(keep);
+            }
+            m_pending_ref = ali.RefID;
+            m_pending_pos = ali.Position;
+            m_pending.push_back(ali);
+        }
+
+        //Pass on whatever is waiting (at the end of a region)
+        template<typename F>
+        void flush(F keep){
+            if(!m_pending.empty()){
+                release(keep);
+            }
+        }
+
+        //Did any dropped read cover this site? Sites must be asked about in order
+        bool capped(int32_t ref_id, int32_t pos);
+        uint64_t dropped() const { return m_dropped; }
+
+    private:
+        struct Interval{
+            int32_t ref_id;
+            int32_t start;
+            int32_t end;
+        };
+        struct Ranked{
+            int sample;
+            uint64_t hash;
+            size_t index;
+            bool operator<(const Ranked& o) const{
+                return sample != o.sample ? sample < o.sample :
+                       hash != o.hash ? hash < o.hash : index < o.index;
+            }
+        };
+        typedef priority_queue<int32_t, vector<int32_t>, greater<int32_t> > EndHeap;
+
+        //Decide on the reads starting at m_pending_pos
+        vector<bool>& choose();
+
+        template<typename F>
+        void release(F keep){
+            vector<bool>& kept = choose();
+            for(size_t i = 0; i < m_pending.size(); i++){
+                if(kept[i]){
+                    keep(m_pending[i]);
+                }
+            }
+            m_pending.clear();
+        }
+
+        SampleSet m_samples;
+        uint32_t m_max_depth;
+        vector<EndHeap> m_active;       //ends of the kept reads, per sample
+        int32_t m_active_ref;
+        int32_t m_active_pos;
+        vector<BamTools::BamAlignment> m_pending;
+        int32_t m_pending_ref;
+        int32_t m_pending_pos;
+        vector<Ranked> m_ranked;
+        vector<bool> m_kept;
+        bool m_flag_sites;
+        deque<Interval> m_capped;       //merged, in order
+        uint64_t m_dropped;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "dup_filter.h"
+
+using namespace std;
+using namespace BamTools;
+
+//Where the read's 5' end would be without clipping: the start for forward
+//reads, the (half-open) end for reverse ones
+static int32_t unclipped_5prime(const BamAlignment& ali){
+    const vector<CigarOp>& cigar = ali.CigarData;
+    if(!ali.IsReverseStrand()){
+        int32_t pos = ali.Position;
+        for(auto op = cigar.begin(); op != cigar.end() && (op->Type == 'S' || op->Type == 'H'); op++){
+            pos -= op->Length;
+        }
+        return pos;
+    }
+    int32_t pos = ali.GetEndPosition();
+    for(auto op = cigar.rbegin(); op != cigar.rend() && (op->Type == 'S' || op->Type == 'H'); op++){
+        pos += op->Length;
+    }
+    return pos;
+}
+
+DuplicateFilter::DuplicateFilter(const SampleSet& samples):
+    m_samples(samples), m_ref(-1), m_pos(-1), m_dropped(0) { }
+
+size_t DuplicateFilter::hold(const BamAlignment& ali){
+    size_t slot;
+    if(m_free.empty()){
+        slot = m_slots.size();
+        m_slots.push_back(Slot());
+    }
+    else{
+        slot = m_free.back();
+        m_free.pop_back();
+    }
+    Slot& s = m_slots[slot];
+    s.ali = ali;
+    bool paired = ali.IsPaired() && ali.IsMateMapped();
+    s.key = Key{ m_samples.index(ali), unclipped_5prime(ali),
+                 paired ? ali.MateRefID : -1, paired ? ali.MatePosition : -1,
+                 ali.IsReverseStrand() };
+    s.held = true;
+    uint64_t h = read_name_hash(ali);
+
+    auto g = m_groups.find(s.key);
+    if(g == m_groups.end()){
+        //groups whose kept read was pushed out by DUP_MAX_HOLD outlive it
+        if(m_groups.size() > 2*m_queue.size() + 1024){
+            for(auto it = m_groups.begin(); it != m_groups.end(); ){
+                it = (it->second.released && m_pos >= it->second.expires) ? m_groups.erase(it) : next(it);
+            }
+        }
+        int32_t expires = s.key.reverse ? s.key.pos : s.key.pos + DUP_CLIP_MAX + 1;
+        m_groups[s.key] = Group{ slot, h, expires, false };
+        return slot;
+    }
+    Group& group = g->second;
+    if(group.released || h >= group.hash){
+        s.held = false;
+        return slot;
+    }
+    m_slots[group.best].held = false;
+    m_dropped++;
+    group.best = slot;
+    group.hash = h;
+    return slot;
+}
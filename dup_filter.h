@@ -0,0 +1,128 @@
+#ifndef dup_filter_H
+#define dup_filter_H
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+#include "api/BamAlignment.h"
+#include "parsers.h"
+
+using namespace std;
+
+//Longest clip allowed before a forward read's 5' end. Forward duplicates
+//with longer clips than this can be missed
+const int32_t DUP_CLIP_MAX = 500;
+//No read is held back for longer than this many bases of input
+const int32_t DUP_MAX_HOLD = 10000;
+
+//--remove-duplicates: drops PCR and optical duplicates as reads come in, so
+//BAMs don't need a duplicate-marking pass first. Reads from the same sample
+//with the same unclipped 5' position, strand and mate position are
+//duplicates. As in DepthFilter, the one with the lowest hash of its name is
+//kept, so the choice doesn't depend on input order and both mates of a pair
+//agree. Each read is held until no later read can be its duplicate, and
+//kept reads are passed on in the order they came. Held reads live in a pool
+//of BamAlignments that is reused as reads go through.
+class DuplicateFilter{
+    public:
+        DuplicateFilter(const SampleSet& samples);
+
+        //Kept reads are passed on to keep(), in position order
+        template<typename F>
+        void add(const BamTools::BamAlignment& ali, F keep){
+            if(ali.RefID != m_ref || ali.Position < m_pos){
+                flush(keep);
+            }
+            m_ref = ali.RefID;
+            m_pos = ali.Position;
+            release(keep, false);
+            size_t slot = hold(ali);
+            if(!m_slots[slot].held){
+                m_free.push_back(slot);
+                m_dropped++;
+                return;
+            }
+            m_queue.push_back(slot);
+        }
+
+        //Pass on everything still held (at the end of a region)
+        template<typename F>
+        void flush(F keep){
+            release(keep, true);
+            m_groups.clear();
+        }
+
+        uint64_t dropped() const { return m_dropped; }
+
+    private:
+        struct Key{
+            int32_t sample;
+            int32_t pos;
+            int32_t mate_ref;
+            int32_t mate_pos;
+            bool reverse;
+            bool operator==(const Key& o) const{
+                return sample == o.sample && pos == o.pos && mate_ref == o.mate_ref &&
+                       mate_pos == o.mate_pos && reverse == o.reverse;
+            }
+        };
+        struct KeyHash{
+            size_t operator()(const Key& k) const{
+                uint64_t h = uint64_t(uint32_t(k.pos)) << 32 | uint32_t(k.mate_pos);
+                h ^= (uint64_t(uint32_t(k.mate_ref)) << 20) ^ (uint64_t(k.sample) << 1) ^ k.reverse;
+                return hash<uint64_t>()(h * 0x9E3779B97F4A7C15ULL);
+            }
+        };
+        struct Group{
+            size_t best;            //slot of the read being kept
+            uint64_t hash;
+            int32_t expires;        //no member can start at or after this
+            bool released;          //the kept read has gone
+        };
+        struct Slot{
+            BamTools::BamAlignment ali;
+            Key key;
+            bool held;              //false once a better duplicate turns up
+        };
+
+        //Copy the read into a free slot and rank it in its group
+        size_t hold(const BamTools::BamAlignment& ali);
+
+        template<typename F>
+        void release(F keep, bool all){
+            while(!m_queue.empty()){
+                Slot& s = m_slots[m_queue.front()];
+                if(s.held){
+                    auto g = m_groups.find(s.key);
+                    bool done = g == m_groups.end() || m_pos >= g->second.expires;
+                    if(!all && !done && m_pos < s.ali.Position + DUP_MAX_HOLD){
+                        break;
+                    }
+                    keep(s.ali);
+                    if(g != m_groups.end()){
+                        if(done){
+                            m_groups.erase(g);
+                        }
+                        else{
+                            g->second.released = true;
+                        }
+                    }
+                }
+                m_free.push_back(m_queue.front());
+                m_queue.pop_front();
+            }
+        }
+
+        SampleSet m_samples;
+        vector<Slot> m_slots;
+        vector<size_t> m_free;
+        deque<size_t> m_queue;          //held reads, in input order
+        unordered_map<Key, Group, KeyHash> m_groups;
+        int32_t m_ref;
+        int32_t m_pos;
+        uint64_t m_dropped;
+};
+
+#endif
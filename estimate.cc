@@ -0,0 +1,211 @@
+#include <cmath>
+#include <algorithm>
+#include <functional>
+
+#include "estimate.h"
+
+using namespace std;
+
+//Most common base first, then the rest in decreasing order
+static ReadData sorted_counts(ReadData counts, uint16_t& major){
+    major = distance(counts.reads, max_element(counts.reads, counts.reads + 4));
+    swap(counts.reads[0], counts.reads[major]);
+    sort(counts.reads + 1, counts.reads + 4, greater<uint16_t>());
+    return counts;
+}
+
+EstimateStats::EstimateStats(): nsites(0){
+    fill(ref_bases, ref_bases + 4, 0);
+    for(auto& row: mismatches){
+        fill(row, row + 4, 0);
+    }
+}
+
+void EstimateStats::add_site(uint16_t ref_allele, const ReadData* counts, size_t nsamples){
+    nsites++;
+    ref_bases[ref_allele]++;
+    for(size_t i = 0; i < nsamples; i++){
+        if(counts[i].key == 0){
+            continue;
+        }
+        uint16_t major;
+        ReadData key = sorted_counts(counts[i], major);
+        if(i == 0){
+            ancestor_hist[key.key]++;
+            if(major == ref_allele){
+                for(size_t b = 0; b < 4; b++){
+                    mismatches[ref_allele][b] += counts[i].reads[b];
+                }
+            }
+        }
+        else{
+            descendant_hist[key.key]++;
+        }
+    }
+}
+
+void EstimateStats::merge(const EstimateStats& other){
+    for(auto& h: other.ancestor_hist){
+        ancestor_hist[h.first] += h.second;
+    }
+    for(auto& h: other.descendant_hist){
+        descendant_hist[h.first] += h.second;
+    }
+    for(size_t i = 0; i < 4; i++){
+        ref_bases[i] += other.ref_bases[i];
+        for(size_t j = 0; j < 4; j++){
+            mismatches[i][j] += other.mismatches[i][j];
+        }
+    }
+    nsites += other.nsites;
+}
+
+
+//Dirichlet-multinomial log-likelihood of a sorted-count key when the first
+//`copies` bases (1 = homozygous/haploid, 2 = heterozygous) are the genotype
+static double genotype_loglik(uint64_t key, int copies, double error, double phi){
+    ReadData d;
+    d.key = key;
+    double alphas_total = (1.0 - phi)/phi;
+    double alphas[4];
+    for(int k = 0; k < 4; k++){
+        if(k < copies){
+            alphas[k] = (copies == 1 ? 1.0 - error : 0.5 - error/3.0) * alphas_total;
+        }
+        else{
+            alphas[k] = error/3.0 * alphas_total;
+        }
+    }
+    return DirichletMultinomialLogProbability(alphas, d);
+}
+
+//Maximise f over [lo, hi], searching on a log scale
+static double golden_max(function<double(double)> f, double lo, double hi){
+    const double g = (sqrt(5.0) - 1.0)/2.0;
+    double a = log(lo), b = log(hi);
+    double c = b - g*(b - a), d = a + g*(b - a);
+    double fc = f(exp(c)), fd = f(exp(d));
+    for(int i = 0; i < 60; i++){
+        if(fc > fd){
+            b = d; d = c; fd = fc;
+            c = b - g*(b - a);
+            fc = f(exp(c));
+        }
+        else{
+            a = c; c = d; fc = fd;
+            d = a + g*(b - a);
+            fd = f(exp(d));
+        }
+    }
+    return exp((a + b)/2.0);
+}
+
+//Fraction of heterozygous ancestors the population prior expects for theta
+static double expected_heterozygosity(ModelParams params, double theta){
+    params.theta = theta;
+    double het = 0.0;
+    for(int r = 0; r < 4; r++){
+        DiploidProbs pop = DiploidPopulation(params, r);
+        double h = 0.0;
+        for(int g = 0; g < NUM_GENOTYPES; g++){
+            if(GENOTYPE_ALLELES[g][0] != GENOTYPE_ALLELES[g][1]){
+                h += pop[g];
+            }
+        }
+        het += params.nuc_freq[r] * h / pop.sum();
+    }
+    return het;
+}
+
+bool fit_params(const EstimateStats& stats, ModelParams& params, ostream& report){
+    uint64_t nbases = stats.ref_bases[0] + stats.ref_bases[1] + stats.ref_bases[2] + stats.ref_bases[3];
+    if(nbases == 0 || stats.descendant_hist.empty() || stats.ancestor_hist.empty()){
+        return false;
+    }
+    params.nuc_freq.assign(4, 0.0);
+    for(int i = 0; i < 4; i++){
+        params.nuc_freq[i] = stats.ref_bases[i] / double(nbases);
+    }
+
+    //Descendants: haploid, so every site is one genotype
+    const unordered_map<uint64_t, uint64_t>& hap = stats.descendant_hist;
+    auto hap_loglik = [&](double error, double phi){
+        double ll = 0.0;
+        for(auto& h: hap){
+            ll += h.second * genotype_loglik(h.first, 1, error, phi);
+        }
+        return ll;
+    };
+    double error = 0.01, phi_haploid = 0.01;
+    for(int round = 0; round < 6; round++){
+        error = golden_max([&](double e){ return hap_loglik(e, phi_haploid); }, 1e-6, 0.25);
+        phi_haploid = golden_max([&](double p){ return hap_loglik(error, p); }, 1e-6, 0.5);
+    }
+    report << "seq-error=" << error << " phi-haploid=" << phi_haploid
+        << " (log-likelihood " << hap_loglik(error, phi_haploid) << ")" << endl;
+
+    //Ancestor: a mixture of homozygous and heterozygous sites
+    const unordered_map<uint64_t, uint64_t>& dip = stats.ancestor_hist;
+    double het = 0.001, phi_diploid = 0.01;
+    unordered_map<uint64_t, double> resp;
+    for(int iter = 0; iter < 30; iter++){
+        double total = 0.0, het_total = 0.0;
+        for(auto& h: dip){
+            double lhom = genotype_loglik(h.first, 1, error, phi_diploid);
+            double lhet = genotype_loglik(h.first, 2, error, phi_diploid);
+            double r = 1.0/(1.0 + (1.0 - het)/het * exp(lhom - lhet));
+            resp[h.first] = r;
+            total += h.second;
+            het_total += h.second * r;
+        }
+        het = min(max(het_total/total, 1e-9), 0.5);
+        phi_diploid = golden_max([&](double p){
+            double ll = 0.0;
+            for(auto& h: dip){
+                double r = resp[h.first];
+                ll += h.second * ((1.0 - r) * genotype_loglik(h.first, 1, error, p) +
+                                  r * genotype_loglik(h.first, 2, error, p));
+            }
+            return ll;
+        }, 1e-6, 0.5);
+    }
+    report << "phi-diploid=" << phi_diploid << " heterozygosity=" << het << endl;
+
+    //theta is whatever makes the prior expect that many heterozygotes
+    double lo = log(1e-8), hi = 0.0;
+    for(int i = 0; i < 60; i++){
+        double mid = (lo + hi)/2.0;
+        if(expected_heterozygosity(params, exp(mid)) < het){
+            lo = mid;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    params.theta = exp((lo + hi)/2.0);
+    params.error_prob = error;
+    params.phi_haploid = phi_haploid;
+    params.phi_diploid = phi_diploid;
+    return true;
+}
+
+void write_params(ostream& out, const ModelParams& params, const EstimateStats& stats){
+    out << "# Estimated by accuMUlate estimate from " << stats.nsites << " sites" << endl;
+    out << "theta=" << params.theta << endl;
+    for(auto f: params.nuc_freq){
+        out << "nfreqs=" << f << endl;
+    }
+    out << "mu=" << params.mutation_rate << " # not estimated" << endl;
+    out << "seq-error=" << params.error_prob << endl;
+    out << "phi-haploid=" << params.phi_haploid << endl;
+    out << "phi-diploid=" << params.phi_diploid << endl;
+    out << "# Ancestor read bases (ACGT) at sites where its major base is the reference:" << endl;
+    const char bases[] = "ACGT";
+    for(int r = 0; r < 4; r++){
+        out << "#   " << bases[r] << ':';
+        for(int b = 0; b < 4; b++){
+            out << ' ' << stats.mismatches[r][b];
+        }
+        out << endl;
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef estimate_H
+#define estimate_H
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+
+#include "model.h"
+
+using namespace std;
+
+// Summaries of the data that are enough to fit the sequencing parameters,
+// for `accuMUlate estimate`. Each thread fills its own and they're merged at
+// the end. Counts at a site are histogrammed with the most common base first
+// and the other three in decreasing order, packed into a ReadData key: the
+// sequencing models treat the three non-genotype bases the same, so nothing
+// the fit needs is lost and the histograms stay small.
+class EstimateStats{
+    public:
+        EstimateStats();
+        // One site: the reference base, then ACGT counts for every sample,
+        // ancestor first
+        void add_site(uint16_t ref_allele, const ReadData* counts, size_t nsamples);
+        void merge(const EstimateStats& other);
+
+        unordered_map<uint64_t, uint64_t> ancestor_hist;
+        unordered_map<uint64_t, uint64_t> descendant_hist;
+        uint64_t ref_bases[4];
+        uint64_t mismatches[4][4];  // reference base => read base, at sites where
+                                    // the ancestor's major base is the reference
+        uint64_t nsites;
+};
+
+// Fit seq-error and phi-haploid to the descendant histogram, then
+// phi-diploid and heterozygosity (=> theta) to the ancestor's with EM over
+// homozygous/heterozygous sites. nfreqs come from the reference bases. mu
+// isn't touched. Returns false if there's no data
+bool fit_params(const EstimateStats& stats, ModelParams& params, ostream& report);
+
+// params as a config file accuMUlate can read with -c
+void write_params(ostream& out, const ModelParams& params, const EstimateStats& stats);
+
+#endif
@@ -0,0 +1,112 @@
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "line_server.h"
+
+using namespace std;
+
+void serve_stream(istream& in, ostream& out, LineHandler handle){
+    string line;
+    while(getline(in, line)){
+        bool go_on = handle(line, out);
+        out.flush();
+        if(!go_on){
+            return;
+        }
+    }
+}
+
+static bool send_all(int fd, const string& data){
+    size_t sent = 0;
+    while(sent < data.size()){
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+//One client: split what comes in into lines and answer each one
+static void serve_connection(int fd, LineHandler& handle){
+    string pending;
+    char buffer[4096];
+    while(true){
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return;
+        }
+        pending.append(buffer, n);
+        size_t newline;
+        while((newline = pending.find('\n')) != string::npos){
+            string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if(!line.empty() && line.back() == '\r'){
+                line.pop_back();
+            }
+            stringstream reply;
+            bool go_on = handle(line, reply);
+            if(!send_all(fd, reply.str()) || !go_on){
+                return;
+            }
+        }
+    }
+}
+
+bool serve_socket(const string& path, LineHandler handle){
+    sockaddr_un addr;
+    if(path.size() >= sizeof(addr.sun_path)){
+        cerr << "Error: socket path " << path << " is too long" << endl;
+        return false;
+    }
+    //a socket left by an earlier run is replaced, anything else is left alone
+    struct stat existing;
+    if(lstat(path.c_str(), &existing) == 0){
+        if(!S_ISSOCK(existing.st_mode)){
+            cerr << "Error: " << path << " exists and isn't a socket" << endl;
+            return false;
+        }
+        unlink(path.c_str());
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0){
+        cerr << "Error: can't create socket: " << strerror(errno) << endl;
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if(bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(server, 8) < 0){
+        cerr << "Error: can't listen on " << path << ": " << strerror(errno) << endl;
+        close(server);
+        return false;
+    }
+    while(true){
+        int client = accept(server, nullptr, nullptr);
+        if(client < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            cerr << "Error: accept failed: " << strerror(errno) << endl;
+            break;
+        }
+        serve_connection(client, handle);
+        close(client);
+    }
+    close(server);
+    unlink(path.c_str());
+    return false;
+}
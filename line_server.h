@@ -0,0 +1,23 @@
+#ifndef line_server_H
+#define line_server_H
+
+#include <string>
+#include <iostream>
+#include <functional>
+
+using namespace std;
+
+// Line protocol plumbing for `accuMUlate serve`. The handler gets one query
+// line and writes its whole reply to the stream; returning false ends the
+// session.
+typedef function<bool(const string& line, ostream& reply)> LineHandler;
+
+// Queries from in, replies to out (flushed after each one), until the input
+// ends or the handler says stop
+void serve_stream(istream& in, ostream& out, LineHandler handle);
+
+// The same over a Unix socket at path, taking one connection at a time and
+// running until killed. Returns false if the socket can't be set up
+bool serve_socket(const string& path, LineHandler handle);
+
+#endif
@@ -3,103 +3,549 @@
 #include <map>
 #include <vector>
 #include <string>
-#include <sys/stat.h>
-
-
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
 
 #include "boost/program_options.hpp"
 #include "api/BamReader.h"
 #include "utils/bamtools_pileup_engine.h"
-#include "utils/bamtools_fasta.h"
 
 #include "model.h"
 #include "parsers.h"
+#include "site_file.h"
+#include "count_file.h"
+#include "merged_reader.h"
+#include "work_queue.h"
+#include "estimate.h"
+#include "depth_filter.h"
+#include "dup_filter.h"
+#include "site_data.h"
+#include "shards.h"
+#include "line_server.h"
+#include "region_mask.h"
 
 using namespace std;
 using namespace BamTools;
 
-                             
+
+//Sites travel to the model in batches: counts for the model plus where each
+//site is. With --threads batches are numbered, so the writer can put them
+//back in order
+struct SiteBatch{
+    size_t seq;
+    vector<int> ref_id;
+    vector<uint64_t> pos;
+    vector<char> ref_base;
+    vector<char> capped;        //with --max-depth: were reads dropped here?
+    vector<SampleSiteData> annotations; //with --annotate: nsamples per site,
+    vector<char> covered;               //and whether any read overlaps the site
+    ModelBatch counts;
+    vector<double> prob;
+    vector<double> prob_one;
+};
+
+const size_t READ_BATCH_SIZE = 1024;
+
+
+//Writes sites that pass the probability cut-off. In tsv a site is written if
+//it passes under any parameter set, with a probability pair per set (and,
+//with --max-depth, a column flagging capped sites, and with --annotate pp's
+//columns). Binary output has one SiteWriter per set.
+class SiteOutput{
+    public:
+        SiteOutput(const vector<string>& contig_names, ostream* out_stream,
+                   const vector<SiteWriter*>& site_writers, double prob_cut):
+            m_contigs(contig_names), m_ostream(out_stream),
+            m_site_writers(site_writers), m_prob_cut(prob_cut) { }
+
+        //Sample names for the pp columns
+        void annotate(const vector<string>& sample_names){
+            m_sample_names = sample_names;
+        }
+
+        void write(const SiteBatch& batch){
+            size_t n = batch.counts.nsites;
+            size_t nsets = batch.prob.size() / n;
+            for(size_t i = 0; i < n; i++){
+                if(!m_site_writers.empty()){
+                    for(size_t k = 0; k < nsets; k++){
+                        if(batch.prob[k*n + i] >= m_prob_cut){
+                            m_site_writers[k]->add(m_contigs[batch.ref_id[i]], batch.pos[i],
+                                                   batch.ref_base[i], batch.prob[k*n + i],
+                                                   batch.prob_one[k*n + i]);
+                        }
+                    }
+                    continue;
+                }
+                bool pass = false;
+                for(size_t k = 0; k < nsets; k++){
+                    pass = pass || batch.prob[k*n + i] >= m_prob_cut;
+                }
+                if(!pass){
+                    continue;
+                }
+                //pp's columns go after the whole line, as if pp had read it.
+                //Like pp, sites without any reads it would use get an NA row,
+                //and the pileup's empty position at the end of a contig, which
+                //no read overlaps, is left out
+                bool annotate = !batch.annotations.empty();
+                if(annotate && !batch.covered[i]){
+                    continue;
+                }
+                stringstream line;
+                ostream* out = annotate ? &line : m_ostream;
+                *out << m_contigs[batch.ref_id[i]] << '\t'
+                     << batch.pos[i] << '\t' 
+                     << batch.ref_base[i] << '\t';
+                for(size_t k = 0; k < nsets; k++){
+                    *out << batch.prob[k*n + i] << '\t' 
+                         << batch.prob_one[k*n + i] << '\t';
+                }
+                if(!batch.capped.empty()){
+                    *out << int(batch.capped[i]) << '\t';
+                }
+                if(!annotate){
+                    *m_ostream << endl;          
+                    continue;
+                }
+                ExperimentSiteData site(m_sample_names, line.str(), batch.ref_base[i]);
+                size_t ns = m_sample_names.size();
+                copy(batch.annotations.begin() + i*ns, batch.annotations.begin() + (i + 1)*ns,
+                     site.sample_data.begin());
+                site.summarize(m_ostream);
+            }
+        }
+    private:
+        vector<string> m_contigs;
+        ostream* m_ostream;
+        vector<SiteWriter*> m_site_writers;
+        double m_prob_cut;
+        vector<string> m_sample_names;
+};
+
+
+//One model per parameter set (just the one without --param-sets). They all
+//run on the same batches, so a sweep only counts the reads once
+struct ModelSets{
+    vector< unique_ptr<TetMAModel> > models;
+    vector<string> labels;
+    double screen_cut = -1;     //--prob with --fast-float, else negative
+
+    size_t size() const { return models.size(); }
+
+    //Invariant sites with the same depths are only worked out once, then
+    //copied to each of them
+    void evaluate(SiteBatch& batch) const{
+        size_t n = batch.counts.nsites;
+        batch.prob.resize(n * models.size());
+        batch.prob_one.resize(n * models.size());
+        ModelBatch compact;
+        vector<size_t> site_of;
+        if(!compact_invariant(batch.counts, compact, site_of)){
+            for(size_t k = 0; k < models.size(); k++){
+                models[k]->evaluate(batch.counts, &batch.prob[k*n], &batch.prob_one[k*n]);
+            }
+        }
+        else{
+            size_t m = compact.nsites;
+            vector<double> prob(m), prob_one(m);
+            for(size_t k = 0; k < models.size(); k++){
+                models[k]->evaluate(compact, prob.data(), prob_one.data());
+                for(size_t i = 0; i < n; i++){
+                    batch.prob[k*n + i] = prob[site_of[i]];
+                    batch.prob_one[k*n + i] = prob_one[site_of[i]];
+                }
+            }
+        }
+        recheck_passing(batch);
+    }
+
+    //A float-screened model only re-checks the sites that might pass under
+    //its own set, but the tsv prints every set's values for a site that
+    //passes under any of them. Those sites are worked out in double for all
+    //sets
+    void recheck_passing(SiteBatch& batch) const{
+        size_t n = batch.counts.nsites;
+        if(screen_cut < 0 || models.size() < 2){
+            return;
+        }
+        const ModelBatch& counts = batch.counts;
+        ModelBatch recheck(counts.nsamples, counts.capacity);
+        vector<size_t> sites;
+        for(size_t i = 0; i < n; i++){
+            bool pass = false;
+            for(size_t k = 0; k < models.size(); k++){
+                pass = pass || batch.prob[k*n + i] >= screen_cut;
+            }
+            if(!pass){
+                continue;
+            }
+            size_t site = recheck.add_site(counts.reference[i]);
+            for(size_t j = 0; j < counts.nsamples; j++){
+                for(size_t b = 0; b < 4; b++){
+                    recheck.counts(j, b)[site] = counts.counts(j, b)[i];
+                }
+            }
+            sites.push_back(i);
+        }
+        vector<double> prob(sites.size()), prob_one(sites.size());
+        for(size_t k = 0; k < models.size() && !sites.empty(); k++){
+            models[k]->evaluate_double(recheck, prob.data(), prob_one.data());
+            for(size_t s = 0; s < sites.size(); s++){
+                batch.prob[k*n + sites[s]] = prob[s];
+                batch.prob_one[k*n + sites[s]] = prob_one[s];
+            }
+        }
+    }
+
+    size_t rechecked() const{
+        size_t n = 0;
+        for(auto& m: models){
+            n += m->rechecked();
+        }
+        return n;
+    }
+};
+
+
+//Full batches of sites go to a sink: straight through the model, to the
+//model workers, or (in count mode) to a count file
+typedef function<void(SiteBatch&)> SiteSink;
+
+//Counts bases per sample at each site into batches. With strand_split
+//reverse-strand reads are counted as sample nsamples+i, so the batch holds
+//all the forward counts followed by all the reverse ones. With a DepthFilter
+//each site is flagged as capped or not, and with annotate set the reads pp
+//would look at are summarised per sample too.
 class VariantVisitor : public PileupVisitor{
     public:
         VariantVisitor(const RefVector& bam_references, 
                        const SamHeader& header,
-                       const Fasta& idx_ref,
-                       ostream *out_stream,
-                       const SampleMap& samples, 
-                       const ModelParams& p,  
+                       const FastaReference& idx_ref,
+                       SiteSink sink,
+                       const SampleSet& samples, 
+                       bool strand_split,
                        BamAlignment& ali, 
                        int qual_cut,
-                       int mapping_cut,
-                       double prob_cut):
-
-            PileupVisitor(), m_idx_ref(idx_ref), m_bam_ref(bam_references), 
-                             m_header(header), m_samples(samples), 
-                             m_qual_cut(qual_cut), m_params(p), m_ali(ali), 
-                             m_ostream(out_stream), m_prob_cut(prob_cut),
-                             m_mapping_cut(mapping_cut)
-                              { }
+                       DepthFilter* depth_filter = nullptr,
+                       bool annotate = false):
+
+            PileupVisitor(), m_idx_ref(idx_ref), m_ref_id(-1), m_bam_ref(bam_references), 
+                             m_header(header), m_samples(samples), m_strand_split(strand_split),
+                             m_qual_cut(qual_cut), m_ali(ali), m_sink(sink),
+                             m_depth_filter(depth_filter), m_annotate(annotate),
+                             m_mask(nullptr)
+                              { new_batch(); }
         ~VariantVisitor(void) { }
     public:
          void Visit(const PileupPosition& pileupData) {
              uint64_t pos  = pileupData.Position;
-             m_idx_ref.GetBase(pileupData.RefId, pos, current_base);
-             ReadDataVector bcalls (m_samples.size(), ReadData{{ 0,0,0,0 }}); 
+             if(m_mask && m_mask->masked(pileupData.RefId, pos)){
+                 return;
+             }
+             if(pileupData.RefId != m_ref_id){
+                 m_ref_id = pileupData.RefId;
+                 m_ref_seq = m_idx_ref.sequence(m_bam_ref[m_ref_id].RefName);
+                 if(!m_ref_seq.data){
+                     cerr << "Warning: " << m_bam_ref[m_ref_id].RefName << " is not in the reference" << endl;
+                 }
+             }
+             current_base = (pos < m_ref_seq.length) ? m_ref_seq[pos] : 'N';
+             uint16_t ref_base_idx = base_index(current_base);
+             if (ref_base_idx > 3){ //TODO Model for bases at which reference is 'N' (=masked for Tt, maybe not others?)
+                 return;
+             }
+             size_t site = m_batch.counts.add_site(ref_base_idx);
+             m_batch.ref_id.push_back(pileupData.RefId);
+             m_batch.pos.push_back(pos);
+             m_batch.ref_base.push_back(current_base);
+             if(m_depth_filter){
+                 m_batch.capped.push_back(m_depth_filter->capped(pileupData.RefId, pos));
+             }
              for(auto it = begin(pileupData.PileupAlignments);
                       it !=  end(pileupData.PileupAlignments); 
                       ++it){
-                 if( include_site(*it, m_mapping_cut, m_qual_cut) ){
-                    it->Alignment.GetTag("RG", tag_id);
-                    uint32_t sindex = m_samples[tag_id]; //TODO check samples existed! 
-                    uint16_t bindex  = base_index(it->Alignment.QueryBases[it->PositionInAlignment]);
+                 if( include_site(*it, m_qual_cut) ){
+                    int sindex = m_samples.index(it->Alignment);
+                    if(sindex < 0){
+                        continue;
+                    }
+                    uint16_t bindex  = base_index(query_base(it->Alignment, it->PositionInAlignment));
                     if (bindex < 4 ){
-                        bcalls[sindex].reads[bindex] += 1;
+                        if(m_strand_split && it->Alignment.IsReverseStrand()){
+                            sindex += m_samples.size();
+                        }
+                        m_batch.counts.counts(sindex, bindex)[site] += 1;
                     }
                 }
             }
-            uint16_t ref_base_idx = base_index(current_base);
-            if (ref_base_idx < 4  ){ //TODO Model for bases at which reference is 'N' (=masked for Tt, maybe not others?)
-                ModelInput d = {ref_base_idx, bcalls};
-                double prob_one = TetMAProbOneMutation(m_params,d);
-                double prob = TetMAProbability(m_params, d);
-                if(prob >= m_prob_cut){
-                     *m_ostream << m_bam_ref[pileupData.RefId].RefName << '\t'
-                                << pos << '\t' 
-                                << current_base << '\t' 
-                                << prob << '\t' 
-                                << prob_one << '\t' 
-                                << endl;          
-                }
+            if(m_annotate){
+                annotate(pileupData);
             }
+            if(m_batch.counts.full()){
+                Flush();
+            }
+         }
+
+         //Leave out sites masked by --exclude (null for none)
+         void set_mask(const RegionMask* mask){
+             m_mask = mask;
+         }
+
+         //Hand on any partly-filled batch
+         void Flush(){
+             if(m_batch.counts.nsites == 0){
+                 return;
+             }
+             m_sink(m_batch);
+             new_batch();
          }
     private:
+        void annotate(const PileupPosition& pileupData){
+            size_t first = m_batch.annotations.size();
+            m_batch.annotations.resize(first + m_samples.size());
+            m_batch.covered.push_back(!pileupData.PileupAlignments.empty());
+            for(auto& pa: pileupData.PileupAlignments){
+                if(pa.Alignment.MapQuality <= ANNOTATE_MAPPING_QUAL){
+                    continue;
+                }
+                if(!include_site(pa, ANNOTATE_BASE_QUAL)){
+                    continue;
+                }
+                uint16_t bindex = base_index(query_base(pa.Alignment, pa.PositionInAlignment));
+                int sindex = m_samples.index(pa.Alignment);
+                if(bindex < 4 && sindex >= 0){
+                    m_batch.annotations[first + sindex].import_alignment(pa.Alignment,
+                                                                         pa.PositionInAlignment,
+                                                                         bindex);
+                }
+            }
+        }
+
         RefVector m_bam_ref;
         SamHeader m_header;
-        Fasta m_idx_ref; 
-        ostream* m_ostream;
-        SampleMap m_samples;
+        const FastaReference& m_idx_ref; 
+        int m_ref_id;
+        SequenceView m_ref_seq;
+        SiteBatch m_batch;
+        SampleSet m_samples;
+        bool m_strand_split;
         BamAlignment& m_ali;
-        ModelParams m_params;
+        SiteSink m_sink;
         int m_qual_cut;
-        int m_mapping_cut;
-        double m_prob_cut;
+        DepthFilter* m_depth_filter;
+        bool m_annotate;
+        const RegionMask* m_mask;
         char current_base;
-        string tag_id;
         uint64_t chr_index;
+
+        void new_batch(){
+            m_batch = SiteBatch();
+            m_batch.counts = ModelBatch(m_samples.size() * (m_strand_split ? 2 : 1));
+        }
 };
 
 
+//Calls every read that passes the read filters in the given regions (or the
+//whole file if there are none). With a mask, long masked runs are skipped with
+//the index, so reads that only cover them are never decoded
+template<typename F>
+void for_each_read(MergedBamReader& experiment, const vector<BedInterval>& regions,
+                   int mapping_cut, F f, const RegionMask* mask = nullptr){
+    BamAlignment ali;
+    bool jump = mask && experiment.HasIndex();
+    if(regions.empty() && !jump){
+        while( experiment.GetNextAlignmentCore(ali)){
+            if( include_read(ali, mapping_cut) ){
+                f(ali);
+            }
+        }  
+        return;
+    }
+    vector<BedInterval> todo = regions;
+    if(todo.empty()){
+        for(auto& r: experiment.GetReferenceData()){
+            todo.push_back(BedInterval{ r.RefName, 0, static_cast<uint64_t>(r.RefLength) });
+        }
+    }
+    for(auto& region: todo){
+        vector<BedInterval> parts(1, region);
+        if(jump){
+            parts = mask->unmasked(region, MASK_JUMP_MIN);
+        }
+        //Reads starting before the last jump have been passed on already
+        uint64_t done = 0;
+        for(auto& part: parts){
+            int ref_id = experiment.GetReferenceID(part.chr);
+            experiment.SetRegion(ref_id, part.start, ref_id, part.end);
+            while( experiment.GetNextAlignmentCore(ali) ){
+                if( static_cast<uint64_t>(ali.Position) >= done && include_read(ali, mapping_cut) ){
+                    f(ali);
+                }
+            }
+            done = part.end;
+        }
+    }
+}
 
-int main(int argc, char** argv){
 
-    namespace po = boost::program_options;
-    string ref_file;
-    string config_path;
-    po::options_description cmd("Command line options");
-    cmd.add_options()
+//Runs the pileup over every read. With threaded set, reads are decoded on a
+//thread of their own and handed over in batches. With a DuplicateFilter
+//and/or a DepthFilter reads go through them (in that order) on their way
+//into the pileup
+void count_sites(MergedBamReader& experiment, const vector<BedInterval>& regions,
+                 int mapping_cut, VariantVisitor* v, bool threaded,
+                 DepthFilter* depth_filter = nullptr, const RegionMask* mask = nullptr,
+                 DuplicateFilter* dup_filter = nullptr){
+    v->set_mask(mask);
+    PileupEngine pileup;
+    pileup.AddVisitor(v);
+    auto add = [&](const BamAlignment& read){
+        pileup.AddAlignment(read);
+    };
+    auto cap = [&](const BamAlignment& read){
+        if(depth_filter){
+            depth_filter->add(read, add);
+        }
+        else{
+            pileup.AddAlignment(read);
+        }
+    };
+    auto filter = [&](const BamAlignment& read){
+        if(dup_filter){
+            dup_filter->add(read, cap);
+        }
+        else{
+            cap(read);
+        }
+    };
+    if(!threaded){
+        for_each_read(experiment, regions, mapping_cut, filter, mask);
+    }
+    else{
+        WorkQueue< vector<BamAlignment> > read_queue(8);
+        thread decoder([&]{
+            vector<BamAlignment> batch;
+            for_each_read(experiment, regions, mapping_cut, [&](const BamAlignment& ali){
+                batch.push_back(ali);
+                if(batch.size() == READ_BATCH_SIZE){
+                    read_queue.push(move(batch));
+                    batch.clear();
+                }
+            }, mask);
+            if(!batch.empty()){
+                read_queue.push(move(batch));
+            }
+            read_queue.close();
+        });
+        vector<BamAlignment> batch;
+        while(read_queue.pop(batch)){
+            for(auto& ali: batch){
+                filter(ali);
+            }
+        }
+        decoder.join();
+    }
+    if(dup_filter){
+        dup_filter->flush(cap);
+    }
+    if(depth_filter){
+        depth_filter->flush(add);
+    }
+    pileup.Flush();
+    v->Flush();
+}
+
+
+//Runs the model on nworkers threads. produce() runs on a thread of its own
+//and pushes batches (numbered from 0) to site_queue. Batches are written
+//here, in order, so the output matches a serial run
+template<typename F>
+void run_model_threads(F produce, WorkQueue<SiteBatch>& site_queue,
+                       const ModelSets& models, SiteOutput& output, int nworkers){
+    WorkQueue<SiteBatch> result_queue(4 * nworkers);
+    thread producer([&]{
+        produce();
+        site_queue.close();
+    });
+
+    atomic<int> running(nworkers);
+    vector<thread> workers;
+    for(int w = 0; w < nworkers; w++){
+        workers.push_back(thread([&]{
+            SiteBatch batch;
+            while(site_queue.pop(batch)){
+                models.evaluate(batch);
+                result_queue.push(move(batch));
+            }
+            if(--running == 0){
+                result_queue.close();
+            }
+        }));
+    }
+
+    map<size_t, SiteBatch> pending;
+    size_t next_seq = 0;
+    SiteBatch batch;
+    while(result_queue.pop(batch)){
+        size_t seq = batch.seq;
+        pending[seq] = move(batch);
+        for(auto it = pending.find(next_seq); it != pending.end(); it = pending.find(next_seq)){
+            output.write(it->second);
+            pending.erase(it);
+            next_seq++;
+        }
+    }
+    producer.join();
+    for(auto& w: workers){
+        w.join();
+    }
+}
+
+
+//A sink that evaluates batches as they come (nthreads == 1) or numbers them
+//and queues them for run_model_threads
+SiteSink model_sink(const ModelSets& models, SiteOutput& output,
+                    WorkQueue<SiteBatch>& site_queue, int nthreads){
+    if(nthreads > 1){
+        shared_ptr<size_t> seq(new size_t(0));
+        return [&site_queue, seq](SiteBatch& batch){
+            batch.seq = (*seq)++;
+            site_queue.push(move(batch));
+        };
+    }
+    return [&models, &output](SiteBatch& batch){
+        models.evaluate(batch);
+        output.write(batch);
+    };
+}
+
+
+//Option groups, shared between modes
+namespace po = boost::program_options;
+
+po::options_description general_options(){
+    po::options_description opts("General");
+    opts.add_options()
         ("help,h", "Print a help message")
-        ("bam,b", po::value<string>()->required(), "Path to BAM file")
-        ("bam-index,x", po::value<string>()->default_value(""), "Path to BAM index, (defalult is <bam_path>.bai")
-        ("reference,r", po::value<string>(&ref_file)->required(),  "Path to reference genome")
+        ("config,c", po::value<string>(), "Path to config file")
+        ("threads,t", po::value<int>()->default_value(1),
+                    "Threads: >1 runs read decoding, pileup and the model as a pipeline");
+    return opts;
+}
+
+po::options_description bam_options(){
+    po::options_description opts("Reads");
+    opts.add_options()
+        ("bam,b", po::value<vector<string> >()->required(), "Path to BAM file (repeat for one BAM per sample/line)")
+        ("bam-index,x", po::value<vector<string> >(), "Path to BAM index, one per BAM (defalult is <bam_path>.bai")
+        ("sample-per-file", "Treat each BAM as one sample, ignoring read groups")
+        ("reference,r", po::value<string>()->required(),  "Path to reference genome")
 //       ("ancestor,a", po::value<string>(&anc_tag), "Ancestor RG sample ID")
 //        ("sample-name,s", po::value<vector <string> >()->required(), "Sample tags")
         ("qual,q", po::value<int>()->default_value(13), 
@@ -107,34 +553,68 @@ int main(int argc, char** argv){
         
         ("mapping-qual,m", po::value<int>()->default_value(13), 
                     "Mapping quality cuttoff")
-     
+        ("max-depth", po::value<int>()->default_value(0),
+                    "Keep at most this many reads per sample over any site (0 for no limit)")
+        ("exclude", po::value<vector<string> >(), "BED file of regions to leave out (repeat for more)")
+        ("remove-duplicates", "Drop duplicate reads as they're read in, for BAMs that haven't been through MarkDuplicates")
+        ("block-cache", po::value<int>()->default_value(BLOCK_CACHE_MB),
+                    "MB of inflated BAM blocks to keep for regions that land in blocks already read (0 for none)")
+        ("intervals,i", po::value<string>(), "Path to bed file");
+    return opts;
+}
+
+po::options_description model_options(){
+    po::options_description opts("Model");
+    opts.add_options()
         ("prob,p", po::value<double>()->default_value(0.1),
                    "Mutaton probability cut-off")
-        ("out,o", po::value<string>()->default_value("acuMUlate_result.tsv"),
-                    "Out file name")
-        ("intervals,i", po::value<string>(), "Path to bed file")
-        ("config,c", po::value<string>(), "Path to config file")
+        ("fast-float", "Screen sites with a single-precision model, re-checking in double any that might pass --prob")
+        ("param-sets", po::value<string>(),
+                   "File of parameter sets to call under in one pass (see README)")
         ("theta", po::value<double>()->required(), "theta")            
         ("nfreqs", po::value<vector<double> >()->multitoken(), "")     
         ("mu", po::value<double>()->required(), "")  
         ("seq-error", po::value<double>()->required(), "") 
         ("phi-haploid",     po::value<double>()->required(), "") 
-        ("phi-diploid",     po::value<double>()->required(), ""); 
+        ("phi-diploid",     po::value<double>()->required(), "") 
+        ("ancestor-ploidy", po::value<int>()->default_value(DEFAULT_PLOIDY.ancestor),
+                   "Ploidy of the ancestor (1 or 2)")
+        ("descendant-ploidy", po::value<int>()->default_value(DEFAULT_PLOIDY.descendant),
+                   "Ploidy of the MA lines (1, or 2 with a diploid ancestor)");
+    return opts;
+}
 
-    po::variables_map vm;
+po::options_description output_options(){
+    po::options_description opts("Output");
+    opts.add_options()
+        ("out,o", po::value<string>()->default_value("acuMUlate_result.tsv"),
+                    "Out file name")
+        ("out-format", po::value<string>()->default_value("tsv"),
+                    "Out file format, 'tsv' or 'binary' (indexed, see sites2tsv)");
+    return opts;
+}
+
+//Parse the command line, then the config file if there is one. Returns false
+//if the mode shouldn't go on (help was printed)
+bool parse_options(int argc, char** argv, const po::options_description& cmd,
+                   po::variables_map& vm, bool ignore_unknown_config){
     po::store(po::parse_command_line(argc, argv, cmd), vm);
 
     if (vm.count("help")){
         cout << cmd << endl;
-        return 0;
+        return false;
     }
 
     if (vm.count("config")){
         ifstream config_stream (vm["config"].as<string>());
-        po::store(po::parse_config_file(config_stream, cmd, false), vm);
+        po::store(po::parse_config_file(config_stream, cmd, ignore_unknown_config), vm);
     }
 
     vm.notify();
+    return true;
+}
+
+ModelParams model_params(const po::variables_map& vm){
     ModelParams params = {
         vm["theta"].as<double>(),
         vm["nfreqs"].as<vector< double> >(),
@@ -143,92 +623,852 @@ int main(int argc, char** argv){
         vm["phi-haploid"].as<double>(), 
         vm["phi-diploid"].as<double>(),
     };
-    string bam_path = vm["bam"].as<string>();
-    string index_path = vm["bam-index"].as<string>();
-    if(index_path == ""){
-        index_path = bam_path + ".bai";
-    }   
+    return params;
+}
 
-    ofstream result_stream (vm["out"].as<string>());
-    // Start setiing up files
-    //TODO: check sucsess of all these opens/reads:
+//Each line of a --param-sets file is one or more key=value settings that
+//override the parameters given as options. A comma-separated list of values
+//makes a grid: "mu=1e-8,1e-7 phi-haploid=0.001,0.01" is four sets. nfreqs
+//takes all four frequencies, comma-separated.
+bool read_param_sets(const string& path, const ModelParams& base,
+                     vector<ModelParams>& sets, vector<string>& labels){
+    ifstream in(path);
+    if(!in){
+        cerr << "Error: can't open parameter sets " << path << endl;
+        return false;
+    }
+    string line;
+    while(getline(in, line)){
+        line = line.substr(0, line.find('#'));
+        stringstream tokens(line);
+        vector<ModelParams> grid(1, base);
+        vector<string> grid_labels(1, "");
+        string token;
+        while(tokens >> token){
+            size_t eq = token.find('=');
+            string key = token.substr(0, eq);
+            vector<double> values;
+            if(eq != string::npos){
+                stringstream vs(token.substr(eq + 1));
+                string v;
+                while(getline(vs, v, ',')){
+                    values.push_back(atof(v.c_str()));
+                }
+            }
+            if(key == "nfreqs"){
+                if(values.size() != 4){
+                    cerr << "Error: nfreqs needs 4 values in " << token << endl;
+                    return false;
+                }
+                for(auto& p: grid){
+                    p.nuc_freq = values;
+                }
+                for(auto& l: grid_labels){
+                    l += (l.empty() ? "" : " ") + token;
+                }
+                continue;
+            }
+            double ModelParams::*field = nullptr;
+            if(key == "theta") field = &ModelParams::theta;
+            else if(key == "mu") field = &ModelParams::mutation_rate;
+            else if(key == "seq-error") field = &ModelParams::error_prob;
+            else if(key == "phi-haploid") field = &ModelParams::phi_haploid;
+            else if(key == "phi-diploid") field = &ModelParams::phi_diploid;
+            if(!field || values.empty()){
+                cerr << "Error: can't use '" << token << "' in " << path << endl;
+                return false;
+            }
+            vector<ModelParams> next;
+            vector<string> next_labels;
+            for(size_t i = 0; i < grid.size(); i++){
+                for(auto v: values){
+                    ModelParams p = grid[i];
+                    p.*field = v;
+                    next.push_back(p);
+                    stringstream label;
+                    label << grid_labels[i] << (grid_labels[i].empty() ? "" : " ") << key << "=" << v;
+                    next_labels.push_back(label.str());
+                }
+            }
+            grid = next;
+            grid_labels = next_labels;
+        }
+        if(grid_labels[0].empty()){
+            continue; //blank line
+        }
+        sets.insert(sets.end(), grid.begin(), grid.end());
+        labels.insert(labels.end(), grid_labels.begin(), grid_labels.end());
+    }
+    return !sets.empty();
+}
 
-    BamReader experiment; 
-    experiment.Open(bam_path);
-    experiment.OpenIndex(index_path);
-    RefVector references = experiment.GetReferenceData(); 
-    SamHeader header = experiment.GetHeader();
+//The models for this run: from the options, or one per --param-sets entry.
+//float_screen false ignores --fast-float
+bool build_models(const po::variables_map& vm, ModelSets& models, bool float_screen = true){
+    ModelParams base = model_params(vm);
+    Ploidy ploidy = { vm["ancestor-ploidy"].as<int>(), vm["descendant-ploidy"].as<int>() };
+    if(!ploidy_supported(ploidy)){
+        cerr << "Error: no model for a ploidy " << ploidy.ancestor << " ancestor with ploidy "
+             << ploidy.descendant << " lines" << endl;
+        return false;
+    }
+    vector<ModelParams> sets(1, base);
+    models.labels.assign(1, "");
+    if(vm.count("param-sets")){
+        sets.clear();
+        models.labels.clear();
+        if(!read_param_sets(vm["param-sets"].as<string>(), base, sets, models.labels)){
+            return false;
+        }
+        for(size_t k = 0; k < sets.size(); k++){
+            cerr << "Parameter set " << k + 1 << ": " << models.labels[k] << endl;
+        }
+    }
+    for(auto& p: sets){
+        models.models.emplace_back(new TetMAModel(p, ploidy));
+        if(float_screen && vm.count("fast-float")){
+            models.models.back()->set_float_screen(vm["prob"].as<double>());
+            models.screen_cut = vm["prob"].as<double>();
+        }
+    }
+    return true;
+}
+
+vector<BedInterval> read_intervals(const po::variables_map& vm){
+    vector<BedInterval> regions;
+    if (vm.count("intervals")){
+        BedFile bed (vm["intervals"].as<string>());
+        BedInterval region;
+        while(bed.get_interval(region) == 0){
+            regions.push_back(region);
+        }
+    }
+    return regions;
+}
 
-    
-    //Fasta reference
-    Fasta reference_genome; // BamTools::Fasta
-    struct stat file_info;
-    string faidx_path = ref_file + ".fai";
-    if (stat(faidx_path.c_str(), &file_info) != 0){
-        reference_genome.Open(ref_file);
-        reference_genome.CreateIndex(faidx_path);
+//The --max-depth filter, left null if there's no limit. False if the limit
+//is out of range. flag_sites if the output flags capped sites
+bool depth_filter(const po::variables_map& vm, const SampleSet& samples,
+                  unique_ptr<DepthFilter>& filter, bool flag_sites = false){
+    int max_depth = vm["max-depth"].as<int>();
+    if(max_depth < 0 || max_depth > UINT16_MAX){
+        cerr << "Error: --max-depth must be between 0 and " << UINT16_MAX << endl;
+        return false;
+    }
+    if(max_depth > 0){
+        filter.reset(new DepthFilter(samples, max_depth, flag_sites));
     }
-    reference_genome.Open(ref_file, faidx_path);
+    return true;
+}
+
+//--block-cache, in bytes
+size_t block_cache_bytes(const po::variables_map& vm){
+    return static_cast<size_t>(max(0, vm["block-cache"].as<int>())) << 20;
+}
+
+//How much the block cache saved, for the run report
+void report_block_cache(const MergedBamReader& experiment){
+    uint64_t hits, misses;
+    experiment.BlockCacheStats(hits, misses);
+    if(hits + misses > 0){
+        cerr << "block-cache: " << hits << " of " << hits + misses << " blocks reused" << endl;
+    }
+}
+
+//The --remove-duplicates filter, left null if it's not wanted
+void duplicate_filter(const po::variables_map& vm, const SampleSet& samples,
+                      unique_ptr<DuplicateFilter>& filter){
+    if(vm.count("remove-duplicates")){
+        filter.reset(new DuplicateFilter(samples));
+    }
+}
 
-    // Map readgroups to samples
-    // TODO: this presumes first sample is ancestor. True for our data, not for
-    // others.
-    // First map all sample names to an index for ReadDataVectors
-    SampleMap name_map;
-    uint16_t sindex = 0;
-    for(auto it = header.ReadGroups.Begin(); it!= header.ReadGroups.End(); it++){
-        if(it->HasSample()){
-            auto s  = name_map.find(it->Sample);
-            if( s == name_map.end()){ // not in there yet
-                name_map[it->Sample] = sindex;
-                sindex += 1;
+//Everything count mode and the default mode need to start reading BAMs
+struct BamInput{
+    MergedBamReader experiment;
+    RefVector references;
+    SamHeader header;
+    unique_ptr<FastaReference> reference_genome;
+    SampleSet samples;
+    vector<string> contig_names;
+    unique_ptr<RegionMask> mask;
+
+    bool open(const po::variables_map& vm){
+        vector<string> bam_paths = vm["bam"].as<vector<string> >();
+        vector<string> index_paths;
+        if(vm.count("bam-index")){
+            index_paths = vm["bam-index"].as<vector<string> >();
+        }
+        if(!experiment.Open(bam_paths, index_paths)){
+            return false;
+        }
+        experiment.SetBlockCache(block_cache_bytes(vm));
+        references = experiment.GetReferenceData(); 
+        header = experiment.GetHeader();
+        for(auto& r: references){
+            contig_names.push_back(r.RefName);
+        }
+        //Fasta reference, mmaped (and indexed if there's no .fai yet)
+        reference_genome.reset(new FastaReference(vm["reference"].as<string>()));
+        if(!reference_genome->good()){
+            return false;
+        }
+        if(vm.count("exclude")){
+            mask.reset(new RegionMask(references));
+            for(auto& path: vm["exclude"].as<vector<string> >()){
+                if(!mask->add_bed(path)){
+                    return false;
+                }
             }
+            cerr << "exclude: " << mask->masked_bases() << " bases masked" << endl;
         }
+        // Map readgroups (or whole files) to samples. The first sample is taken
+        // to be the ancestor, so it needs to be in the first BAM
+        return experiment.samples(vm.count("sample-per-file"), samples);
     }
-    // And now, go back over the read groups to map RG:sample index
-    SampleMap samples;
-    for(auto it = header.ReadGroups.Begin(); it!= header.ReadGroups.End(); it++){
-        if(it->HasSample()){
-            samples[it->ID] = name_map[it->Sample];  
+};
+
+//tsv stream or SiteWriters, from --out and --out-format. Binary output of a
+//parameter sweep goes to one file per set, <out>.1, <out>.2 ...
+struct ResultFile{
+    ofstream result_stream;
+    vector< unique_ptr<SiteWriter> > site_writers;
+    vector<string> paths;
+
+    bool open(const po::variables_map& vm, size_t nsets){
+        string out_format = vm["out-format"].as<string>();
+        if(out_format != "tsv" && out_format != "binary"){
+            cerr << "Error: unknown --out-format '" << out_format << "'" << endl;
+            return false;
+        }
+        string out = vm["out"].as<string>();
+        if(out_format == "binary"){
+            for(size_t k = 0; k < nsets; k++){
+                string path = nsets == 1 ? out : out + "." + to_string(k + 1);
+                site_writers.emplace_back(new SiteWriter(path));
+                paths.push_back(path);
+                if(!site_writers.back()->good()){
+                    cerr << "Error: can't write to " << path << endl;
+                    return false;
+                }
+            }
         }
+        else{
+            result_stream.open(out);
+            paths.push_back(out);
+            if(!result_stream){
+                cerr << "Error: can't write to " << out << endl;
+                return false;
+            }
+        }
+        return true;
     }
 
-    PileupEngine pileup;
-    BamAlignment ali;
+    vector<SiteWriter*> writers() const{
+        vector<SiteWriter*> w;
+        for(auto& sw: site_writers){
+            w.push_back(sw.get());
+        }
+        return w;
+    }
+
+    //False, after saying so, if anything couldn't be written (a full disk,
+    //say), in which case the run mustn't be marked done
+    bool close(){
+        bool ok = true;
+        for(size_t k = 0; k < site_writers.size(); k++){
+            site_writers[k]->close();
+            if(!site_writers[k]->good()){
+                cerr << "Error: couldn't write all of " << paths[k] << endl;
+                ok = false;
+            }
+        }
+        if(result_stream.is_open()){
+            result_stream.close();
+            if(!result_stream){
+                cerr << "Error: couldn't write all of " << paths[0] << endl;
+                ok = false;
+            }
+        }
+        return ok;
+    }
+};
+
 
+//accuMUlate count: pileup counts only, for re-calling with `call`
+int count_main(int argc, char** argv){
+    po::options_description cmd("accuMUlate count [options]");
+    cmd.add(general_options()).add(bam_options());
+    cmd.add_options()
+        ("out,o", po::value<string>()->required(), "Count file to write")
+        ("strand-split", "Keep forward and reverse strand counts apart");
+    po::variables_map vm;
+    //the same config file as for calling can be used, model options and all
+    if(!parse_options(argc, argv, cmd, vm, true)){
+        return 0;
+    }
+    BamInput input;
+    if(!input.open(vm)){
+        return 1;
+    }
+    unique_ptr<DepthFilter> filter;
+    if(!depth_filter(vm, input.samples, filter)){
+        return 1;
+    }
+    unique_ptr<DuplicateFilter> dups;
+    duplicate_filter(vm, input.samples, dups);
+    bool strand_split = vm.count("strand-split");
+    CountWriter counts(vm["out"].as<string>(), input.samples.names, strand_split);
+    if(!counts.good()){
+        cerr << "Error: can't write to " << vm["out"].as<string>() << endl;
+        return 1;
+    }
+    vector<uint16_t> site_counts(counts.ncounts());
+    BamAlignment ali;
     VariantVisitor *v = new VariantVisitor(
-            references,
-            header,
-            reference_genome, 
-            &result_stream,
-//            vm["sample-name"].as<vector< string> >(),
-            samples,
-            params, 
-            ali, 
-            vm["qual"].as<int>(), 
-            vm["mapping-qual"].as<int>(),
-            vm["prob"].as<double>()
+            input.references,
+            input.header,
+            *input.reference_genome,
+            [&](SiteBatch& batch){
+                const ModelBatch& b = batch.counts;
+                for(size_t i = 0; i < b.nsites; i++){
+                    for(size_t j = 0; j < b.nsamples; j++){
+                        for(size_t k = 0; k < 4; k++){
+                            site_counts[j*4 + k] = b.counts(j, k)[i];
+                        }
+                    }
+                    counts.add(input.contig_names[batch.ref_id[i]], batch.pos[i],
+                               batch.ref_base[i], site_counts.data());
+                }
+            },
+            input.samples,
+            strand_split,
+            ali,
+            vm["qual"].as<int>()
         );
-    pileup.AddVisitor(v);
-   
-    if (vm.count("intervals")){
-        BedFile bed (vm["intervals"].as<string>());
-        BedInterval region;
-        while(bed.get_interval(region) == 0){
-            int ref_id = experiment.GetReferenceID(region.chr);
-            experiment.SetRegion(ref_id, region.start, ref_id, region.end);
-            while( experiment.GetNextAlignment(ali) ){
-                pileup.AddAlignment(ali);
+    count_sites(input.experiment, read_intervals(vm), vm["mapping-qual"].as<int>(), v,
+                vm["threads"].as<int>() > 1, filter.get(), input.mask.get(), dups.get());
+    counts.close();
+    if(dups){
+        cerr << "remove-duplicates: " << dups->dropped() << " reads dropped" << endl;
+    }
+    if(filter){
+        cerr << "max-depth: " << filter->dropped() << " reads dropped" << endl;
+    }
+    report_block_cache(input.experiment);
+    if(!counts.good()){
+        cerr << "Error: couldn't write all of " << vm["out"].as<string>() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+
+//accuMUlate call: the model from a count file
+int call_main(int argc, char** argv){
+    po::options_description cmd("accuMUlate call [options]");
+    cmd.add(general_options()).add(model_options()).add(output_options());
+    cmd.add_options()
+        ("counts", po::value<string>()->required(), "Count file from accuMUlate count")
+        ("intervals,i", po::value<string>(), "Path to bed file");
+    po::variables_map vm;
+    if(!parse_options(argc, argv, cmd, vm, false)){
+        return 0;
+    }
+    CountReader counts(vm["counts"].as<string>());
+    if(!counts.good()){
+        return 1;
+    }
+    ModelSets models;
+    if(!build_models(vm, models)){
+        return 1;
+    }
+    ResultFile results;
+    if(!results.open(vm, models.size())){
+        return 1;
+    }
+    SiteOutput output(counts.contigs(), &results.result_stream, results.writers(),
+                      vm["prob"].as<double>());
+    int nthreads = vm["threads"].as<int>();
+    WorkQueue<SiteBatch> site_queue(4 * nthreads);
+    SiteSink sink = model_sink(models, output, site_queue, nthreads);
+
+    size_t nsamples = counts.sample_names().size();
+    vector<BedInterval> regions = read_intervals(vm);
+    auto produce = [&]{
+        SiteBatch batch;
+        batch.counts = ModelBatch(nsamples);
+        CountRecord record;
+        size_t r = 0;
+        do{
+            if(!regions.empty()){
+                counts.set_region(regions[r].chr, regions[r].start, regions[r].end);
             }
+            while(counts.next(record)){
+                uint16_t ref_base_idx = base_index(record.ref_base);
+                if(ref_base_idx > 3){
+                    continue;
+                }
+                size_t site = batch.counts.add_site(ref_base_idx);
+                batch.ref_id.push_back(record.contig);
+                batch.pos.push_back(record.pos);
+                batch.ref_base.push_back(record.ref_base);
+                for(size_t j = 0; j < nsamples; j++){
+                    for(size_t k = 0; k < 4; k++){
+                        uint16_t c = record.counts[j*4 + k];
+                        if(counts.strand_split()){
+                            c += record.counts[(nsamples + j)*4 + k];
+                        }
+                        batch.counts.counts(j, k)[site] = c;
+                    }
+                }
+                if(batch.counts.full()){
+                    sink(batch);
+                    batch = SiteBatch();
+                    batch.counts = ModelBatch(nsamples);
+                }
+            }
+        } while(++r < regions.size());
+        if(batch.counts.nsites > 0){
+            sink(batch);
         }
+    };
+    if(nthreads > 1){
+        run_model_threads(produce, site_queue, models, output, max(1, nthreads - 1));
     }
     else{
-        while( experiment.GetNextAlignment(ali)){
-            pileup.AddAlignment(ali);
-        }  
+        produce();
     }
-    pileup.Flush();
+    if(vm.count("fast-float")){
+        cerr << "fast-float: " << models.rechecked() << " sites re-checked in double" << endl;
+    }
+    bool written = results.close();
+    //a corrupt block stops the run part way: no done marker
+    if(!counts.good() || !written){
+        return 1;
+    }
+    write_done_marker(vm["out"].as<string>(), regions);
+    return 0;
+}
+
+
+//accuMUlate estimate: fit the sequencing parameters to the data and write
+//them out as a config file. Contigs (or the intervals) are cut into chunks
+//that --threads threads take in turn, each with its own readers and stats
+int estimate_main(int argc, char** argv){
+    po::options_description cmd("accuMUlate estimate [options]");
+    cmd.add(general_options()).add(bam_options());
+    cmd.add_options()
+        ("out,o", po::value<string>()->default_value("params.ini"), "Config file to write")
+        ("mu", po::value<double>()->default_value(1e-8), "mu to write (it can't be estimated)")
+        ("chunk-size", po::value<uint64_t>()->default_value(1000000), "Bases per work chunk");
+    po::variables_map vm;
+    if(!parse_options(argc, argv, cmd, vm, true)){
+        return 0;
+    }
+    BamInput input;
+    unique_ptr<DepthFilter> check;
+    if(!input.open(vm) || !depth_filter(vm, input.samples, check)){
+        return 1;
+    }
+    vector<BedInterval> chunks;
+    vector<BedInterval> regions = read_intervals(vm);
+    if(regions.empty()){
+        for(auto& r: input.references){
+            regions.push_back(BedInterval{ r.RefName, 0, static_cast<uint64_t>(r.RefLength) });
+        }
+    }
+    uint64_t chunk_size = max<uint64_t>(1, vm["chunk-size"].as<uint64_t>());
+    for(auto& r: regions){
+        for(uint64_t start = r.start; start < r.end; start += chunk_size){
+            chunks.push_back(BedInterval{ r.chr, start, min(r.end, start + chunk_size) });
+        }
+    }
+
+    int nthreads = max(1, vm["threads"].as<int>());
+    vector<string> bam_paths = vm["bam"].as<vector<string> >();
+    vector<string> index_paths;
+    if(vm.count("bam-index")){
+        index_paths = vm["bam-index"].as<vector<string> >();
+    }
+    vector<EstimateStats> stats(nthreads);
+    atomic<size_t> next_chunk(0);
+    atomic<bool> failed(false);
+    auto work = [&](int t){
+        MergedBamReader experiment;
+        SampleSet samples;
+        if(!experiment.Open(bam_paths, index_paths) ||
+           !experiment.samples(vm.count("sample-per-file"), samples)){
+            failed = true;
+            return;
+        }
+        experiment.SetBlockCache(block_cache_bytes(vm) / nthreads);
+        unique_ptr<DepthFilter> filter;
+        depth_filter(vm, samples, filter);
+        unique_ptr<DuplicateFilter> dups;
+        duplicate_filter(vm, samples, dups);
+        EstimateStats& s = stats[t];
+        vector<ReadData> site(samples.size());
+        const BedInterval* chunk = nullptr;
+        BamAlignment ali;
+        VariantVisitor v(
+                input.references,
+                input.header,
+                *input.reference_genome,
+                [&](SiteBatch& batch){
+                    const ModelBatch& b = batch.counts;
+                    for(size_t i = 0; i < b.nsites; i++){
+                        //reads overlapping the chunk edges pile up outside it
+                        if(batch.pos[i] < chunk->start || batch.pos[i] >= chunk->end){
+                            continue;
+                        }
+                        for(size_t j = 0; j < b.nsamples; j++){
+                            for(size_t k = 0; k < 4; k++){
+                                site[j].reads[k] = b.counts(j, k)[i];
+                            }
+                        }
+                        s.add_site(b.reference[i], site.data(), b.nsamples);
+                    }
+                },
+                samples,
+                false,
+                ali,
+                vm["qual"].as<int>()
+            );
+        for(size_t c = next_chunk++; c < chunks.size(); c = next_chunk++){
+            chunk = &chunks[c];
+            count_sites(experiment, vector<BedInterval>(1, *chunk),
+                        vm["mapping-qual"].as<int>(), &v, false, filter.get(), input.mask.get(),
+                        dups.get());
+        }
+    };
+    vector<thread> threads;
+    for(int t = 1; t < nthreads; t++){
+        threads.push_back(thread(work, t));
+    }
+    work(0);
+    for(auto& t: threads){
+        t.join();
+    }
+    if(failed){
+        return 1;
+    }
+    for(int t = 1; t < nthreads; t++){
+        stats[0].merge(stats[t]);
+    }
+
+    ModelParams params = {};
+    params.mutation_rate = vm["mu"].as<double>();
+    if(!fit_params(stats[0], params, cerr)){
+        cerr << "Error: no covered sites to estimate from" << endl;
+        return 1;
+    }
+    ofstream out(vm["out"].as<string>());
+    write_params(out, params, stats[0]);
     return 0;
 }
 
 
+//accuMUlate serve: keep the BAMs, reference and models loaded and answer
+//queries about sites, one per line, on stdin or a Unix socket (see README)
+int serve_main(int argc, char** argv){
+    po::options_description cmd("accuMUlate serve [options]");
+    cmd.add(general_options()).add(bam_options()).add(model_options());
+    cmd.add_options()
+        ("socket", po::value<string>(), "Listen on this Unix socket instead of stdin/stdout");
+    po::variables_map vm;
+    if(!parse_options(argc, argv, cmd, vm, false)){
+        return 0;
+    }
+    BamInput input;
+    ModelSets models;
+    //a call query asks for the probabilities themselves, so they're always
+    //worked out in double
+    if(vm.count("fast-float")){
+        cerr << "Warning: serve ignores --fast-float" << endl;
+    }
+    if(!input.open(vm) || !build_models(vm, models, false)){
+        return 1;
+    }
+    int mapping_cut = vm["mapping-qual"].as<int>();
+    int qual_cut = vm["qual"].as<int>();
+    const vector<string>& names = input.samples.names;
+
+    auto handle = [&](const string& line, ostream& reply){
+        stringstream fields(line);
+        string command, where, pos_s;
+        fields >> command;
+        if(command.empty()){
+            return true;
+        }
+        if(command == "quit"){
+            return false;
+        }
+        if(command == "samples"){
+            for(auto& n: names){
+                reply << n << '\n';
+            }
+            reply << ".\n";
+            return true;
+        }
+        //`<command> chr pos` for one site, `<command> chr:start-end` for a region
+        BedInterval region;
+        fields >> where;
+        bool parsed;
+        if(fields >> pos_s){
+            try{
+                uint64_t pos = stoull(pos_s);
+                region = BedInterval{ where, pos, pos + 1 };
+                parsed = true;
+            }
+            catch(const exception&){
+                parsed = false;
+            }
+        }
+        else{
+            parsed = parse_region(where, region);
+        }
+        int ref_id = parsed ? input.experiment.GetReferenceID(region.chr) : -1;
+        if(command != "counts" && command != "call" && command != "pp" && command != "freq"){
+            reply << "error\tunknown command '" << command << "'\n.\n";
+            return true;
+        }
+        if(!parsed || ref_id < 0){
+            reply << "error\tcan't find region '" << where << (pos_s.empty() ? "" : " ") << pos_s << "'\n.\n";
+            return true;
+        }
+        region.end = min<uint64_t>(region.end, input.references[ref_id].RefLength);
+
+        vector<SiteBatch> batches;
+        BamAlignment ali;
+        VariantVisitor v(input.references, input.header, *input.reference_genome,
+                         [&](SiteBatch& batch){ batches.push_back(move(batch)); },
+                         input.samples, false, ali, qual_cut, nullptr, command == "pp");
+        unique_ptr<DuplicateFilter> dups;
+        duplicate_filter(vm, input.samples, dups);
+        count_sites(input.experiment, vector<BedInterval>(1, region), mapping_cut, &v, false,
+                    nullptr, input.mask.get(), dups.get());
+
+        stringstream log;
+        for(auto& batch: batches){
+            models.evaluate(batch);
+            const ModelBatch& b = batch.counts;
+            size_t n = b.nsites;
+            for(size_t i = 0; i < n; i++){
+                //reads overlapping the region pile up outside it too
+                if(batch.pos[i] < region.start || batch.pos[i] >= region.end){
+                    continue;
+                }
+                stringstream site;
+                site << region.chr << '\t' << batch.pos[i] << '\t' << batch.ref_base[i] << '\t';
+                if(command == "counts"){
+                    for(size_t j = 0; j < b.nsamples; j++){
+                        site << b.counts(j, 0)[i] << ',' << b.counts(j, 1)[i] << ','
+                             << b.counts(j, 2)[i] << ',' << b.counts(j, 3)[i] << '\t';
+                    }
+                }
+                else if(command == "freq"){
+                    //fraction of each sample's reads that aren't the reference base
+                    for(size_t j = 0; j < b.nsamples; j++){
+                        uint32_t depth = 0;
+                        for(size_t k = 0; k < 4; k++){
+                            depth += b.counts(j, k)[i];
+                        }
+                        if(depth == 0){
+                            site << "NA\t";
+                        }
+                        else{
+                            site << (depth - b.counts(j, b.reference[i])[i]) / double(depth) << '\t';
+                        }
+                    }
+                }
+                else{
+                    for(size_t k = 0; k < models.size(); k++){
+                        site << batch.prob[k*n + i] << '\t' << batch.prob_one[k*n + i] << '\t';
+                    }
+                }
+                if(command != "pp"){
+                    reply << site.str() << '\n';
+                    continue;
+                }
+                //as pp would write it for the caller's line
+                if(!batch.covered[i]){
+                    continue;
+                }
+                ExperimentSiteData pp_site(names, site.str(), batch.ref_base[i]);
+                copy(batch.annotations.begin() + i*names.size(),
+                     batch.annotations.begin() + (i + 1)*names.size(),
+                     pp_site.sample_data.begin());
+                pp_site.summarize(&reply, log);
+            }
+        }
+        reply << ".\n";
+        return true;
+    };
+
+    if(vm.count("socket")){
+        bool ok = serve_socket(vm["socket"].as<string>(), handle);
+        report_block_cache(input.experiment);
+        return ok ? 0 : 1;
+    }
+    serve_stream(cin, cout, handle);
+    report_block_cache(input.experiment);
+    return 0;
+}
+
+//accuMUlate merge: put the calls and denominators from a sharded run back
+//together, after checking every shard finished and no two overlap
+int merge_main(int argc, char** argv){
+    po::options_description cmd("accuMUlate merge [options]");
+    cmd.add_options()
+        ("help,h", "Print a help message")
+        ("manifest,m", po::value<string>()->required(), "Shard manifest (see README)")
+        ("out,o", po::value<string>()->required(), "Merged calls (tsv); summed denominators go to stdout");
+    po::variables_map vm;
+    if(!parse_options(argc, argv, cmd, vm, false)){
+        return 0;
+    }
+    vector<Shard> shards;
+    if(!read_manifest(vm["manifest"].as<string>(), shards) || !check_shards(shards)){
+        return 1;
+    }
+    //The calls go to <out>.tmp, which only replaces <out> once everything is
+    //merged, so a merge that fails part way leaves no partial output
+    string out_path = vm["out"].as<string>();
+    string tmp_path = out_path + ".tmp";
+    ofstream out(tmp_path);
+    if(!out){
+        cerr << "Error: can't write to " << tmp_path << endl;
+        return 1;
+    }
+    stringstream denoms;
+    bool ok = merge_calls(shards, out) && sum_denoms(shards, denoms);
+    out.close();
+    if(ok && !out){
+        cerr << "Error: couldn't write all of " << tmp_path << endl;
+        ok = false;
+    }
+    if(ok && rename(tmp_path.c_str(), out_path.c_str()) != 0){
+        cerr << "Error: can't rename " << tmp_path << " to " << out_path << endl;
+        ok = false;
+    }
+    if(!ok){
+        remove(tmp_path.c_str());
+        return 1;
+    }
+    cout << denoms.str();
+    return 0;
+}
+
+
+int main(int argc, char** argv){
+    //Sub-commands: `accuMUlate count ...`, `call ...`, `estimate ...`,
+    //`merge ...` and `serve ...`. With no sub-command the BAMs are counted and
+    //called in one go.
+    if(argc > 1 && argv[1][0] != '-'){
+        string mode = argv[1];
+        if(mode == "count"){
+            return count_main(argc - 1, argv + 1);
+        }
+        if(mode == "call"){
+            return call_main(argc - 1, argv + 1);
+        }
+        if(mode == "estimate"){
+            return estimate_main(argc - 1, argv + 1);
+        }
+        if(mode == "merge"){
+            return merge_main(argc - 1, argv + 1);
+        }
+        if(mode == "serve"){
+            return serve_main(argc - 1, argv + 1);
+        }
+        cerr << "Error: unknown mode '" << mode << "' (expected count, call, estimate, merge or serve)" << endl;
+        return 1;
+    }
+
+    po::options_description cmd("Command line options");
+    cmd.add(general_options()).add(bam_options()).add(model_options()).add(output_options());
+    cmd.add_options()
+        ("annotate", "Add pp's columns (strand counts, mean BQ/MQ per allele) to sites that pass --prob");
+    po::variables_map vm;
+    if(!parse_options(argc, argv, cmd, vm, false)){
+        return 0;
+    }
+    if(vm.count("annotate") && vm["out-format"].as<string>() != "tsv"){
+        cerr << "Error: --annotate needs tsv output" << endl;
+        return 1;
+    }
+    ModelSets models;
+    if(!build_models(vm, models)){
+        return 1;
+    }
+    ResultFile results;
+    if(!results.open(vm, models.size())){
+        return 1;
+    }
+    // Start setiing up files
+    //TODO: check sucsess of all these opens/reads:
+    BamInput input;
+    unique_ptr<DepthFilter> filter;
+    if(!input.open(vm) || !depth_filter(vm, input.samples, filter, true)){
+        return 1;
+    }
+    unique_ptr<DuplicateFilter> dups;
+    duplicate_filter(vm, input.samples, dups);
+
+    BamAlignment ali;
+    int mapping_cut = vm["mapping-qual"].as<int>();
+    int nthreads = vm["threads"].as<int>();
+    vector<BedInterval> regions = read_intervals(vm);
+
+    SiteOutput output(input.contig_names, &results.result_stream, results.writers(),
+                      vm["prob"].as<double>());
+    bool annotate = vm.count("annotate");
+    if(annotate){
+        if(mapping_cut > ANNOTATE_MAPPING_QUAL){
+            cerr << "Warning: --annotate summarises reads with mapping quality over "
+                 << ANNOTATE_MAPPING_QUAL << " but --mapping-qual drops some of them" << endl;
+        }
+        output.annotate(input.samples.names);
+    }
+    WorkQueue<SiteBatch> site_queue(4 * nthreads);
+    VariantVisitor *v = new VariantVisitor(
+            input.references,
+            input.header,
+            *input.reference_genome, 
+            model_sink(models, output, site_queue, nthreads),
+//            vm["sample-name"].as<vector< string> >(),
+            input.samples,
+            false,
+            ali, 
+            vm["qual"].as<int>(),
+            filter.get(),
+            annotate
+        );
+
+    if(nthreads > 1){
+        //one thread decodes reads, one runs the pileup, the rest the model
+        run_model_threads([&]{ count_sites(input.experiment, regions, mapping_cut, v, true,
+                                           filter.get(), input.mask.get(), dups.get()); },
+                          site_queue, models, output, max(1, nthreads - 2));
+    }
+    else{
+        count_sites(input.experiment, regions, mapping_cut, v, false, filter.get(), input.mask.get(),
+                    dups.get());
+    }
+    if(dups){
+        cerr << "remove-duplicates: " << dups->dropped() << " reads dropped" << endl;
+    }
+    if(filter){
+        cerr << "max-depth: " << filter->dropped() << " reads dropped" << endl;
+    }
+    if(vm.count("fast-float")){
+        cerr << "fast-float: " << models.rechecked() << " sites re-checked in double" << endl;
+    }
+    report_block_cache(input.experiment);
+    if(!results.close()){
+        return 1;
+    }
+    write_done_marker(vm["out"].as<string>(), regions);
+    return 0;
+}
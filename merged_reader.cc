@@ -0,0 +1,279 @@
+#include <iostream>
+#include <algorithm>
+#include <climits>
+
+#include "merged_reader.h"
+
+using namespace std;
+using namespace BamTools;
+
+//alignments decoded per read-ahead batch
+static const size_t MERGE_BATCH_SIZE = 512;
+
+MergedBamReader::MergedBamReader(): m_threaded(false), m_started(false) { }
+
+MergedBamReader::~MergedBamReader(){
+    stop();
+}
+
+bool MergedBamReader::Open(const vector<string>& bam_paths, const vector<string>& index_paths){
+    if(!index_paths.empty() && index_paths.size() != bam_paths.size()){
+        cerr << "Error: give one --bam-index per --bam (or none)" << endl;
+        return false;
+    }
+    for(size_t i = 0; i < bam_paths.size(); i++){
+        unique_ptr<Source> s(new Source);
+        s->path = bam_paths[i];
+        s->tag_file = false;
+        if(!s->reader.Open(s->path)){
+            cerr << "Error: can't open BAM " << s->path << endl;
+            return false;
+        }
+        string index_path = index_paths.empty() ? "" : index_paths[i];
+        if(index_path == ""){
+            index_path = s->path + ".bai";
+        }
+        s->reader.OpenIndex(index_path);
+        //all files have to be aligned to the same reference, in the same
+        //order, or RefIDs mean different things in different files
+        const RefVector& refs = s->reader.GetReferenceData();
+        if(i == 0){
+            m_references = refs;
+            m_header = s->reader.GetHeader();
+        }
+        else{
+            bool same = refs.size() == m_references.size();
+            for(size_t r = 0; same && r < refs.size(); r++){
+                same = refs[r].RefName == m_references[r].RefName &&
+                       refs[r].RefLength == m_references[r].RefLength;
+            }
+            if(!same){
+                cerr << "Error: " << s->path << " has different reference sequences to "
+                     << bam_paths[0] << endl;
+                return false;
+            }
+            SamHeader header = s->reader.GetHeader();
+            for(auto it = header.ReadGroups.Begin(); it != header.ReadGroups.End(); it++){
+                if(!m_header.ReadGroups.Contains(it->ID)){
+                    m_header.ReadGroups.Add(*it);
+                }
+            }
+        }
+        s->ready.resize(MERGE_BATCH_SIZE);
+        s->filling.resize(MERGE_BATCH_SIZE);
+        m_sources.push_back(move(s));
+    }
+    m_threaded = m_sources.size() > 1;
+    return !m_sources.empty();
+}
+
+bool MergedBamReader::samples(bool sample_per_file, SampleSet& sample_set){
+    // First file's samples come first, so the ancestor has to be in there
+    for(auto& s: m_sources){
+        SamHeader header = s->reader.GetHeader();
+        vector<string> file_samples;
+        for(auto it = header.ReadGroups.Begin(); it!= header.ReadGroups.End(); it++){
+            if(it->HasSample() &&
+               find(file_samples.begin(), file_samples.end(), it->Sample) == file_samples.end()){
+                file_samples.push_back(it->Sample);
+            }
+        }
+        if(sample_per_file || file_samples.empty()){
+            string name;
+            if(file_samples.size() == 1){
+                name = file_samples[0];
+            }
+            else{
+                name = s->path.substr(s->path.find_last_of('/') + 1);
+            }
+            sample_set.files[s->path] = sample_set.add_sample(name);
+            s->tag_file = true;
+            continue;
+        }
+        for(auto it = header.ReadGroups.Begin(); it!= header.ReadGroups.End(); it++){
+            if(!it->HasSample()){
+                continue;
+            }
+            uint16_t sindex = sample_set.add_sample(it->Sample);
+            auto rg = sample_set.read_groups.find(it->ID);
+            if(rg != sample_set.read_groups.end() && rg->second != sindex){
+                cerr << "Error: read group " << it->ID << " is used for samples "
+                     << sample_set.names[rg->second] << " and " << it->Sample
+                     << " (try --sample-per-file)" << endl;
+                return false;
+            }
+            sample_set.read_groups[it->ID] = sindex;
+        }
+    }
+    return true;
+}
+
+int MergedBamReader::GetReferenceID(const string& name) const{
+    return m_sources.empty() ? -1 : m_sources[0]->reader.GetReferenceID(name);
+}
+
+bool MergedBamReader::HasIndex() const{
+    for(auto& s: m_sources){
+        if(!s->reader.HasIndex()){
+            return false;
+        }
+    }
+    return !m_sources.empty();
+}
+
+void MergedBamReader::SetBlockCache(size_t bytes){
+    for(auto& s: m_sources){
+        s->reader.SetBlockCacheSize(bytes / m_sources.size());
+    }
+}
+
+void MergedBamReader::BlockCacheStats(uint64_t& hits, uint64_t& misses) const{
+    hits = misses = 0;
+    for(auto& s: m_sources){
+        uint64_t h, m;
+        s->reader.GetBlockCacheStats(h, m);
+        hits += h;
+        misses += m;
+    }
+}
+
+bool MergedBamReader::SetRegion(const int& left_ref, const int& left_pos,
+                                const int& right_ref, const int& right_pos){
+    stop();
+    bool ok = true;
+    for(auto& s: m_sources){
+        ok = s->reader.SetRegion(left_ref, left_pos, right_ref, right_pos) && ok;
+    }
+    return ok;
+}
+
+void MergedBamReader::fill(Source& s){
+    size_t n = 0;
+    while(n < MERGE_BATCH_SIZE && s.reader.GetNextAlignmentCore(s.filling[n])){
+        if(s.tag_file){
+            s.filling[n].Filename = s.path;
+        }
+        n++;
+    }
+    s.filling_count = n;
+}
+
+//Read-ahead thread: keeps one batch decoded while the last is being merged
+void MergedBamReader::prefetch(Source& s){
+    while(true){
+        unique_lock<mutex> l(s.lock);
+        s.cv.wait(l, [&]{ return s.stop || !s.filled; });
+        if(s.stop){
+            return;
+        }
+        l.unlock();
+        fill(s);
+        l.lock();
+        s.filled = true;
+        l.unlock();
+        s.cv.notify_all();
+    }
+}
+
+//Make sure s has a read waiting, false once the file (or region) is done
+bool MergedBamReader::advance(Source& s){
+    if(s.ready_pos < s.ready_count){
+        return true;
+    }
+    if(!m_threaded){
+        fill(s);
+    }
+    else{
+        unique_lock<mutex> l(s.lock);
+        s.cv.wait(l, [&]{ return s.filled; });
+    }
+    swap(s.ready, s.filling);
+    s.ready_count = s.filling_count;
+    s.ready_pos = 0;
+    if(m_threaded){
+        {
+            lock_guard<mutex> l(s.lock);
+            s.filled = false;
+        }
+        s.cv.notify_all();
+    }
+    return s.ready_count > 0;
+}
+
+void MergedBamReader::start(){
+    for(auto& s: m_sources){
+        s->ready_count = 0;
+        s->ready_pos = 0;
+        s->filling_count = 0;
+        s->filled = false;
+        s->stop = false;
+        if(m_threaded){
+            s->worker = thread(&MergedBamReader::prefetch, this, ref(*s));
+        }
+    }
+    m_heap.clear();
+    for(size_t i = 0; i < m_sources.size(); i++){
+        if(advance(*m_sources[i])){
+            push_heap_entry(i);
+        }
+    }
+    m_started = true;
+}
+
+void MergedBamReader::stop(){
+    if(m_started && m_threaded){
+        for(auto& s: m_sources){
+            {
+                lock_guard<mutex> l(s->lock);
+                s->stop = true;
+            }
+            s->cv.notify_all();
+            s->worker.join();
+        }
+    }
+    m_heap.clear();
+    m_started = false;
+}
+
+//Coordinate order, unmapped reads (RefID -1) last, ties go to the earlier file
+bool MergedBamReader::before(size_t a, size_t b) const{
+    const BamAlignment& x = m_sources[a]->ready[m_sources[a]->ready_pos];
+    const BamAlignment& y = m_sources[b]->ready[m_sources[b]->ready_pos];
+    int xref = x.RefID < 0 ? INT_MAX : x.RefID;
+    int yref = y.RefID < 0 ? INT_MAX : y.RefID;
+    if(xref != yref){
+        return xref < yref;
+    }
+    if(x.Position != y.Position){
+        return x.Position < y.Position;
+    }
+    return a < b;
+}
+
+void MergedBamReader::push_heap_entry(size_t i){
+    m_heap.push_back(i);
+    push_heap(m_heap.begin(), m_heap.end(), [&](size_t a, size_t b){ return before(b, a); });
+}
+
+size_t MergedBamReader::pop_heap_entry(){
+    pop_heap(m_heap.begin(), m_heap.end(), [&](size_t a, size_t b){ return before(b, a); });
+    size_t i = m_heap.back();
+    m_heap.pop_back();
+    return i;
+}
+
+bool MergedBamReader::GetNextAlignmentCore(BamAlignment& ali){
+    if(!m_started){
+        start();
+    }
+    if(m_heap.empty()){
+        return false;
+    }
+    size_t i = pop_heap_entry();
+    Source& s = *m_sources[i];
+    ali = s.ready[s.ready_pos++];
+    if(advance(s)){
+        push_heap_entry(i);
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef merged_reader_H
+#define merged_reader_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "api/BamReader.h"
+#include "parsers.h"
+
+using namespace std;
+
+//Default --block-cache, in MB
+const int BLOCK_CACHE_MB = 64;
+
+//Reads one or more coordinate-sorted BAMs (e.g. one per MA line) as a single
+//sorted stream, so nobody has to merge them first. Each file is decoded into
+//batches of alignments; with more than one file every file gets its own
+//read-ahead thread, and a binary heap on (RefID, Position) picks the next
+//read. Alignments are read core-only, as in the rest of the caller.
+class MergedBamReader{
+    public:
+        MergedBamReader();
+        ~MergedBamReader();
+        //index_paths may be empty, in which case <bam>.bai is used
+        bool Open(const vector<string>& bam_paths, const vector<string>& index_paths);
+        bool GetNextAlignmentCore(BamTools::BamAlignment& ali);
+        bool SetRegion(const int& left_ref, const int& left_pos,
+                       const int& right_ref, const int& right_pos);
+        int GetReferenceID(const string& name) const;
+        //Whether every file has an index to jump around with
+        bool HasIndex() const;
+        //Memory for inflated BGZF blocks, split between the files, so
+        //SetRegion calls landing in blocks already read don't inflate them
+        //again (0 turns the cache off)
+        void SetBlockCache(size_t bytes);
+        //Block cache hits and misses, over all files
+        void BlockCacheStats(uint64_t& hits, uint64_t& misses) const;
+        const BamTools::RefVector& GetReferenceData() const { return m_references; }
+        //Header of the first file, plus the read groups of all the others
+        const BamTools::SamHeader& GetHeader() const { return m_header; }
+        //Samples from RG/SM. Files without read groups, or every file when
+        //sample_per_file is set, are treated as a single sample each.
+        bool samples(bool sample_per_file, SampleSet& sample_set);
+
+    private:
+        struct Source{
+            BamTools::BamReader reader;
+            string path;
+            bool tag_file;                       // set ali.Filename for SampleSet
+            vector<BamTools::BamAlignment> ready;
+            size_t ready_count;
+            size_t ready_pos;
+            vector<BamTools::BamAlignment> filling;
+            size_t filling_count;
+            bool filled;
+            bool stop;
+            mutex lock;
+            condition_variable cv;
+            thread worker;
+        };
+        void fill(Source& s);
+        void prefetch(Source& s);
+        bool advance(Source& s);
+        void start();
+        void stop();
+        bool before(size_t a, size_t b) const;
+        void push_heap_entry(size_t i);
+        size_t pop_heap_entry();
+
+        vector<unique_ptr<Source> > m_sources;
+        vector<size_t> m_heap;
+        bool m_threaded;
+        bool m_started;
+        BamTools::RefVector m_references;
+        BamTools::SamHeader m_header;
+};
+
+#endif
@@ -5,8 +5,12 @@
 #include <initializer_list>
 #include <iostream>
 #include <map>
+#include <unordered_map>
+#include <string>
 #include <fstream>
 #include <memory>
+#include <algorithm>
+#include <cassert>
 #include "Eigen/Dense"
 
 #include "model.h"
@@ -30,30 +34,37 @@ double DirichletMultinomialLogProbability(double alphas[4], ReadData data) {
 	return result;
 }
 
+const int GENOTYPE_ALLELES[NUM_GENOTYPES][2] = {
+	{0,0}, {0,1}, {0,2}, {0,3}, {1,1}, {1,2}, {1,3}, {2,2}, {2,3}, {3,3}
+};
+
+//Heterozygotes can arise two ways, so get twice the prior of one ordered
+//genotype
 DiploidProbs DiploidPopulation(const ModelParams &params, int ref_allele) {
 	ReadData d;
 	DiploidProbs result;
 	double alphas[4];
 	for(int i : {0,1,2,3})
 		alphas[i] = params.theta*params.nuc_freq[i];
-	for(int i : {0,1,2,3}) {
-		for(int j=0;j<i;++j) {
-			d.key = 0;
-			d.reads[ref_allele] = 1;
-			d.reads[i] += 1;
-			d.reads[j] += 1;
-			result[i+j*4] = DirichletMultinomialLogProbability(alphas, d);
-			result[j+i*4] = result[i+j*4];
-		}
+	for(int g = 0; g < NUM_GENOTYPES; ++g) {
+		int i = GENOTYPE_ALLELES[g][0];
+		int j = GENOTYPE_ALLELES[g][1];
 		d.key = 0;
 		d.reads[ref_allele] = 1;
-		d.reads[i] += 2;
-		result[i+i*4] = DirichletMultinomialLogProbability(alphas, d);
+		d.reads[i] += 1;
+		d.reads[j] += 1;
+		result[g] = DirichletMultinomialLogProbability(alphas, d);
+	}
+	result = result.exp();
+	for(int g = 0; g < NUM_GENOTYPES; ++g) {
+		if(GENOTYPE_ALLELES[g][0] != GENOTYPE_ALLELES[g][1])
+			result[g] *= 2.0;
 	}
-	return result.exp();
+	return result;
 }
 
-MutationMatrix MutationAccumulation(const ModelParams &params, bool and_mut) {
+//p(allele j after the MA generations | allele i before)
+Eigen::Matrix4d AlleleMutation(const ModelParams &params) {
 	double beta = 1.0;
 	for(auto d : params.nuc_freq)
 		beta -= d*d;
@@ -66,17 +77,22 @@ MutationMatrix MutationAccumulation(const ModelParams &params, bool and_mut) {
 		}
 		m(i,i) += beta;
 	}
+	return m;
+}
+
+MutationMatrix MutationAccumulation(const ModelParams &params, bool and_mut) {
+	Eigen::Matrix4d m = AlleleMutation(params);
 	//cerr << m << endl;
 	MutationMatrix result;
-	for(int i : {0,1,2,3}) {
-		for(int j : {0,1,2,3}) {
-			for(int k : {0,1,2,3}) {
-				result(i*4+j,k) = 0.0;
-				if(!and_mut || i != k)
-					result(i*4+j,k) += 0.5*m(i,k);
-				if(!and_mut || j != k)
-					result(i*4+j,k) += 0.5*m(j,k);
-			}
+	for(int g = 0; g < NUM_GENOTYPES; ++g) {
+		int i = GENOTYPE_ALLELES[g][0];
+		int j = GENOTYPE_ALLELES[g][1];
+		for(int k : {0,1,2,3}) {
+			result(g,k) = 0.0;
+			if(!and_mut || i != k)
+				result(g,k) += 0.5*m(i,k);
+			if(!and_mut || j != k)
+				result(g,k) += 0.5*m(j,k);
 		}
 	}
 	return result;
@@ -85,26 +101,19 @@ MutationMatrix MutationAccumulation(const ModelParams &params, bool and_mut) {
 DiploidProbs DiploidSequencing(const ModelParams &params, int ref_allele, ReadData data) {
 	DiploidProbs result;
 	double alphas_total = (1.0-params.phi_diploid)/params.phi_diploid;
-	for(int i : {0,1,2,3}) {
-		for(int j=0;j<i;++j) {
-			double alphas[4];
-			for(int k : {0,1,2,3}) {
-				if(k == i || k == j)
-					alphas[k] = (0.5-params.error_prob/3.0)*alphas_total;
-				else
-					alphas[k] = (params.error_prob/3.0)*alphas_total;
-			}
-			result[i*4+j] = DirichletMultinomialLogProbability(alphas, data);
-			result[j*4+i] = result[i*4+j];
-		}
+	for(int g = 0; g < NUM_GENOTYPES; ++g) {
+		int i = GENOTYPE_ALLELES[g][0];
+		int j = GENOTYPE_ALLELES[g][1];
 		double alphas[4];
 		for(int k : {0,1,2,3}) {
-			if(k == i)
-				alphas[k] = (1.0-params.error_prob)*alphas_total;
+			if(i == j)
+				alphas[k] = (k == i) ? (1.0-params.error_prob)*alphas_total : params.error_prob/3.0*alphas_total;
+			else if(k == i || k == j)
+				alphas[k] = (0.5-params.error_prob/3.0)*alphas_total;
 			else
-				alphas[k] = params.error_prob/3.0*alphas_total;
+				alphas[k] = (params.error_prob/3.0)*alphas_total;
 		}
-		result[i*4+i] = DirichletMultinomialLogProbability(alphas, data);
+		result[g] = DirichletMultinomialLogProbability(alphas, data);
 	}
 	double scale = result.maxCoeff();
 	return (result - scale).exp();
@@ -174,6 +183,477 @@ double TetMAProbOneMutation(const ModelParams &params, const ModelInput site_dat
     return(result);
 }
 
+ModelBatch::ModelBatch(size_t nsamples, size_t capacity):
+	nsamples(nsamples), capacity(capacity), nsites(0),
+	reference(capacity), reads(nsamples * 4 * capacity) {}
+
+size_t ModelBatch::add_site(uint16_t ref_allele) {
+	size_t site = nsites++;
+	reference[site] = ref_allele;
+	for(size_t i = 0; i < nsamples*4; ++i)
+		reads[i*capacity + site] = 0;
+	return site;
+}
+
+//Both sites invariant: same reference base and the same depth in every sample
+static bool same_depths(const ModelBatch &batch, size_t a, size_t b) {
+	uint16_t ref = batch.reference[a];
+	if(batch.reference[b] != ref)
+		return false;
+	for(size_t i = 0; i < batch.nsamples; ++i) {
+		if(batch.counts(i, ref)[a] != batch.counts(i, ref)[b])
+			return false;
+	}
+	return true;
+}
+
+bool compact_invariant(const ModelBatch &batch, ModelBatch &compact, vector<size_t> &site_of) {
+	//First pass: point each invariant site at the first one with the same
+	//depths, through an open-addressed table of sites keyed by a hash of them
+	size_t n = batch.nsites;
+	size_t slots = 16;
+	while(slots < 2*n)
+		slots *= 2;
+	vector<uint32_t> table(slots, UINT32_MAX);
+	site_of.resize(n);
+	bool repeats = false;
+	for(size_t s = 0; s < n; ++s) {
+		site_of[s] = s;
+		uint16_t ref = batch.reference[s];
+		bool invariant = true;
+		uint64_t h = ref + 1;
+		for(size_t i = 0; i < batch.nsamples && invariant; ++i) {
+			for(int k : {0,1,2,3}) {
+				if(k != ref && batch.counts(i, k)[s] != 0)
+					invariant = false;
+			}
+			h = (h ^ batch.counts(i, ref)[s]) * 0x9E3779B97F4A7C15ULL;
+		}
+		if(!invariant)
+			continue;
+		for(size_t slot = (h ^ (h >> 29)) & (slots - 1); ; slot = (slot + 1) & (slots - 1)) {
+			if(table[slot] == UINT32_MAX) {
+				table[slot] = s;
+				break;
+			}
+			if(same_depths(batch, table[slot], s)) {
+				site_of[s] = table[slot];
+				repeats = true;
+				break;
+			}
+		}
+	}
+	if(!repeats)
+		return false;
+	//Second pass: copy over the first of each, numbering them as in compact
+	compact = ModelBatch(batch.nsamples, batch.capacity);
+	for(size_t s = 0; s < n; ++s) {
+		if(site_of[s] != s) {
+			site_of[s] = site_of[site_of[s]];
+			continue;
+		}
+		size_t site = compact.add_site(batch.reference[s]);
+		for(size_t i = 0; i < batch.nsamples; ++i) {
+			for(int k : {0,1,2,3})
+				compact.counts(i, k)[site] = batch.counts(i, k)[s];
+		}
+		site_of[s] = site;
+	}
+	return true;
+}
+
+//Depths below this come straight from the tables
+const size_t LOG_TABLE_SIZE = 1024;
+//Float screening sends sites whose likelihood total is this small to double
+const float FLOAT_SCREEN_MIN = 1e-30f;
+
+constexpr int Genotypes<1>::count;
+constexpr int Genotypes<2>::count;
+
+//sum_{x<n} log(alpha+x) for each alpha a model uses
+class RisingLogTables {
+	public:
+		size_t add(double alpha) {
+			for(size_t i = 0; i < m_alphas.size(); ++i) {
+				if(m_alphas[i] == alpha)
+					return i;
+			}
+			vector<double> table(LOG_TABLE_SIZE);
+			table[0] = 0.0;
+			for(size_t x = 1; x < LOG_TABLE_SIZE; ++x)
+				table[x] = table[x-1] + log(alpha+x-1);
+			m_alphas.push_back(alpha);
+			m_tables.push_back(table);
+			return m_alphas.size() - 1;
+		}
+		double operator()(size_t table, uint16_t n) const {
+			if(n < LOG_TABLE_SIZE)
+				return m_tables[table][n];
+			double result = m_tables[table][LOG_TABLE_SIZE-1];
+			for(size_t x = LOG_TABLE_SIZE-1; x < n; ++x)
+				result += log(m_alphas[table]+x);
+			return result;
+		}
+	private:
+		vector<double> m_alphas;
+		vector< vector<double> > m_tables;
+};
+
+//The alleles of genotype g (the same one twice for a haploid)
+static void genotype_alleles(int ploidy, int g, int alleles[2]) {
+	alleles[0] = (ploidy == 1) ? g : GENOTYPE_ALLELES[g][0];
+	alleles[1] = (ploidy == 1) ? g : GENOTYPE_ALLELES[g][1];
+}
+
+static int genotype_index(int ploidy, const int alleles[2]) {
+	if(ploidy == 1)
+		return alleles[0];
+	for(int g = 0; g < NUM_GENOTYPES; ++g) {
+		if((GENOTYPE_ALLELES[g][0] == alleles[0] && GENOTYPE_ALLELES[g][1] == alleles[1]) ||
+		   (GENOTYPE_ALLELES[g][0] == alleles[1] && GENOTYPE_ALLELES[g][1] == alleles[0]))
+			return g;
+	}
+	return -1;
+}
+
+//Dirichlet alphas for the reads of a sample with genotype g, as in
+//DiploidSequencing and HaploidSequencing
+static void sequencing_alphas(const ModelParams &params, int ploidy, int g, double alphas[4]) {
+	double phi = (ploidy == 1) ? params.phi_haploid : params.phi_diploid;
+	double alphas_total = (1.0-phi)/phi;
+	int a[2];
+	genotype_alleles(ploidy, g, a);
+	int i = a[0];
+	int j = a[1];
+	for(int k : {0,1,2,3}) {
+		if(i == j)
+			alphas[k] = (k == i) ? (1.0-params.error_prob)*alphas_total : params.error_prob/3.0*alphas_total;
+		else if(k == i || k == j)
+			alphas[k] = (0.5-params.error_prob/3.0)*alphas_total;
+		else
+			alphas[k] = (params.error_prob/3.0)*alphas_total;
+	}
+}
+
+//Prior on the ancestor's genotype: DiploidPopulation, or for a haploid one
+//allele drawn after the reference
+static void population_prior(const ModelParams &params, int ploidy, int ref_allele, double *prior) {
+	if(ploidy == 2) {
+		DiploidProbs p = DiploidPopulation(params, ref_allele);
+		for(int g = 0; g < NUM_GENOTYPES; ++g)
+			prior[g] = p[g];
+		return;
+	}
+	ReadData d;
+	double alphas[4];
+	for(int i : {0,1,2,3})
+		alphas[i] = params.theta*params.nuc_freq[i];
+	for(int i : {0,1,2,3}) {
+		d.key = 0;
+		d.reads[ref_allele] = 1;
+		d.reads[i] += 1;
+		prior[i] = exp(DirichletMultinomialLogProbability(alphas, d));
+	}
+}
+
+//p(descendant genotype | ancestral genotype), over every path (all) and over
+//the paths where no allele mutated (unmutated = all - mutated, as TetMAModel
+//always did for MutationAccumulation). A haploid line from a diploid
+//ancestor inherits either allele, otherwise every allele is passed on, and
+//each inherited allele mutates on its own.
+static void transitions(const ModelParams &params, Ploidy ploidy, double *all, double *unmutated) {
+	Eigen::Matrix4d m = AlleleMutation(params);
+	int anc_genotypes = (ploidy.ancestor == 1) ? Genotypes<1>::count : Genotypes<2>::count;
+	int desc_genotypes = (ploidy.descendant == 1) ? Genotypes<1>::count : Genotypes<2>::count;
+	vector<double> mutated(anc_genotypes*desc_genotypes, 0.0);
+	fill(all, all + anc_genotypes*desc_genotypes, 0.0);
+	for(int g = 0; g < anc_genotypes; ++g) {
+		int a[2];
+		genotype_alleles(ploidy.ancestor, g, a);
+		//the alleles passed on, and the chance of passing on just those
+		int inherited[2][2] = {{a[0], a[1]}, {a[1], a[0]}};
+		int ninherited = 1;
+		double weight = 1.0;
+		if(ploidy.descendant == 1 && ploidy.ancestor == 2) {
+			ninherited = 2;
+			weight = 0.5;
+		}
+		for(int t = 0; t < ninherited; ++t) {
+			//every ordered set of alleles they could mutate into
+			int norders = (ploidy.descendant == 1) ? 4 : 16;
+			for(int o = 0; o < norders; ++o) {
+				int k[2] = {o % 4, o / 4};
+				double p = weight;
+				bool mut = false;
+				for(int c = 0; c < ploidy.descendant; ++c) {
+					p *= m(inherited[t][c], k[c]);
+					mut = mut || inherited[t][c] != k[c];
+				}
+				int h = genotype_index(ploidy.descendant, k);
+				all[g*desc_genotypes + h] += p;
+				if(mut)
+					mutated[g*desc_genotypes + h] += p;
+			}
+		}
+	}
+	for(int i = 0; i < anc_genotypes*desc_genotypes; ++i)
+		unmutated[i] = all[i] - mutated[i];
+}
+
+//The batch model for one design. The genotype counts are compile-time
+//constants, so the loops over genotypes unroll, and the working arrays for
+//up to MODEL_BATCH_SIZE sites at a time live on the stack.
+template<int AncPloidy, int DescPloidy>
+class PloidyModel: public PloidyKernel {
+	public:
+		static constexpr int ANC = Genotypes<AncPloidy>::count;
+		static constexpr int DESC = Genotypes<DescPloidy>::count;
+
+		PloidyModel(const ModelParams &params);
+		void run(const ModelBatch &batch, double *prob, double *prob_one, double *anc_total) const {
+			kernel(batch, prob, prob_one, anc_total);
+		}
+		void run(const ModelBatch &batch, float *prob, float *prob_one, float *anc_total) const {
+			kernel(batch, prob, prob_one, anc_total);
+		}
+	private:
+		template<typename Real>
+		void kernel(const ModelBatch &batch, Real *prob, Real *prob_one, Real *anc_total) const;
+		template<typename Real>
+		void chunk(const ModelBatch &batch, size_t first, size_t n, Real *prob, Real *prob_one, Real *anc_total) const;
+
+		RisingLogTables m_log;
+		double m_m[ANC][DESC];
+		double m_mn[ANC][DESC];
+		double m_pop[4][ANC];
+		size_t m_anc_alpha[ANC][4];
+		size_t m_anc_total[ANC];
+		size_t m_desc_alpha[DESC][4];
+		size_t m_desc_total[DESC];
+};
+
+template<int AncPloidy, int DescPloidy>
+constexpr int PloidyModel<AncPloidy, DescPloidy>::ANC;
+template<int AncPloidy, int DescPloidy>
+constexpr int PloidyModel<AncPloidy, DescPloidy>::DESC;
+
+template<int AncPloidy, int DescPloidy>
+PloidyModel<AncPloidy, DescPloidy>::PloidyModel(const ModelParams &params) {
+	transitions(params, Ploidy{AncPloidy, DescPloidy}, &m_m[0][0], &m_mn[0][0]);
+	for(int r : {0,1,2,3})
+		population_prior(params, AncPloidy, r, m_pop[r]);
+	double alphas[4];
+	for(int g = 0; g < ANC; ++g) {
+		sequencing_alphas(params, AncPloidy, g, alphas);
+		for(int k : {0,1,2,3})
+			m_anc_alpha[g][k] = m_log.add(alphas[k]);
+		m_anc_total[g] = m_log.add(alphas[0]+alphas[1]+alphas[2]+alphas[3]);
+	}
+	for(int h = 0; h < DESC; ++h) {
+		sequencing_alphas(params, DescPloidy, h, alphas);
+		for(int k : {0,1,2,3})
+			m_desc_alpha[h][k] = m_log.add(alphas[k]);
+		m_desc_total[h] = m_log.add(alphas[0]+alphas[1]+alphas[2]+alphas[3]);
+	}
+}
+
+template<int AncPloidy, int DescPloidy>
+template<typename Real>
+void PloidyModel<AncPloidy, DescPloidy>::kernel(const ModelBatch &batch, Real *prob, Real *prob_one, Real *anc_total) const {
+	for(size_t first = 0; first < batch.nsites; first += MODEL_BATCH_SIZE) {
+		size_t n = min(MODEL_BATCH_SIZE, batch.nsites - first);
+		chunk(batch, first, n, prob + first, prob_one + first, anc_total ? anc_total + first : nullptr);
+	}
+}
+
+//All the per-genotype arrays are genotype-major with the sites of the chunk
+//innermost, so each step is a simple loop over sites the compiler can
+//vectorise. Both probabilities share the same products: anc is p(R|A)
+//(denom in TetMAProbOneMutation) and num is p(R & no mutation|A).
+//Log-likelihoods are always summed and max-scaled in double; Real is what
+//the scaled likelihoods and their products are held in.
+template<int AncPloidy, int DescPloidy>
+template<typename Real>
+void PloidyModel<AncPloidy, DescPloidy>::chunk(const ModelBatch &batch, size_t first, size_t n,
+                                               Real *prob, Real *prob_one, Real *anc_total) const {
+	const int MAX_GENOTYPES = (ANC > DESC) ? ANC : DESC;
+	double loglik[MAX_GENOTYPES*MODEL_BATCH_SIZE], scale[MODEL_BATCH_SIZE], total[MODEL_BATCH_SIZE];
+	Real anc[ANC*MODEL_BATCH_SIZE], num[ANC*MODEL_BATCH_SIZE], mut[ANC*MODEL_BATCH_SIZE];
+	Real desc[DESC*MODEL_BATCH_SIZE];
+
+	const uint16_t *r[4];
+	for(int k : {0,1,2,3})
+		r[k] = batch.counts(0, k) + first;
+	for(size_t s = 0; s < n; ++s)
+		total[s] = r[0][s] + r[1][s] + r[2][s] + r[3][s];
+	for(int g = 0; g < ANC; ++g) {
+		double *l = &loglik[g*n];
+		for(size_t s = 0; s < n; ++s) {
+			l[s] = m_log(m_anc_alpha[g][0], r[0][s]) + m_log(m_anc_alpha[g][1], r[1][s])
+			     + m_log(m_anc_alpha[g][2], r[2][s]) + m_log(m_anc_alpha[g][3], r[3][s])
+			     - m_log(m_anc_total[g], total[s]);
+		}
+	}
+	for(size_t s = 0; s < n; ++s)
+		scale[s] = loglik[s];
+	for(int g = 1; g < ANC; ++g) {
+		for(size_t s = 0; s < n; ++s)
+			scale[s] = max(scale[s], loglik[g*n+s]);
+	}
+	const uint16_t *reference = &batch.reference[first];
+	for(int g = 0; g < ANC; ++g) {
+		Real *a = &anc[g*n];
+		for(size_t s = 0; s < n; ++s) {
+			a[s] = exp(Real(loglik[g*n+s] - scale[s])) * Real(m_pop[reference[s]][g]);
+			num[g*n+s] = a[s];
+			mut[g*n+s] = 0;
+		}
+	}
+
+	for(size_t i = 1; i < batch.nsamples; ++i) {
+		for(int k : {0,1,2,3})
+			r[k] = batch.counts(i, k) + first;
+		for(size_t s = 0; s < n; ++s)
+			total[s] = r[0][s] + r[1][s] + r[2][s] + r[3][s];
+		for(int h = 0; h < DESC; ++h) {
+			double *l = &loglik[h*n];
+			for(size_t s = 0; s < n; ++s) {
+				l[s] = m_log(m_desc_alpha[h][0], r[0][s]) + m_log(m_desc_alpha[h][1], r[1][s])
+				     + m_log(m_desc_alpha[h][2], r[2][s]) + m_log(m_desc_alpha[h][3], r[3][s])
+				     - m_log(m_desc_total[h], total[s]);
+			}
+		}
+		for(size_t s = 0; s < n; ++s)
+			scale[s] = loglik[s];
+		for(int h = 1; h < DESC; ++h) {
+			for(size_t s = 0; s < n; ++s)
+				scale[s] = max(scale[s], loglik[h*n+s]);
+		}
+		for(size_t h = 0; h < DESC*n; ++h)
+			desc[h] = exp(Real(loglik[h] - scale[h % n]));
+
+		for(int g = 0; g < ANC; ++g) {
+			Real m[DESC], mn[DESC];
+			for(int h = 0; h < DESC; ++h) {
+				m[h] = m_m[g][h];
+				mn[h] = m_mn[g][h];
+			}
+			Real *a = &anc[g*n], *d = &num[g*n], *u = &mut[g*n];
+			for(size_t s = 0; s < n; ++s) {
+				Real agen = m[0]*desc[s];
+				Real dgen = mn[0]*desc[s];
+				for(int h = 1; h < DESC; ++h) {
+					agen += m[h]*desc[h*n+s];
+					dgen += mn[h]*desc[h*n+s];
+				}
+				a[s] *= agen;
+				d[s] *= dgen;
+				u[s] += agen/dgen - 1;
+			}
+		}
+	}
+
+	for(size_t s = 0; s < n; ++s) {
+		Real anc_sum = 0, num_sum = 0, one_sum = 0;
+		for(int g = 0; g < ANC; ++g) {
+			anc_sum += anc[g*n+s];
+			num_sum += num[g*n+s];
+			one_sum += num[g*n+s] * mut[g*n+s];
+		}
+		prob[s] = 1 - num_sum/anc_sum;
+		prob_one[s] = one_sum/anc_sum;
+		if(anc_total)
+			anc_total[s] = anc_sum;
+	}
+}
+
+template<int AncPloidy, int DescPloidy>
+static PloidyKernel *make_kernel(const ModelParams &params) {
+	return new PloidyModel<AncPloidy, DescPloidy>(params);
+}
+
+//Every design there's a model for
+static const struct {
+	Ploidy ploidy;
+	PloidyKernel *(*make)(const ModelParams &params);
+} PLOIDY_MODELS[] = {
+	{{2, 1}, make_kernel<2, 1>},
+	{{1, 1}, make_kernel<1, 1>},
+	{{2, 2}, make_kernel<2, 2>},
+};
+
+bool ploidy_supported(Ploidy ploidy) {
+	for(auto &model : PLOIDY_MODELS) {
+		if(model.ploidy.ancestor == ploidy.ancestor && model.ploidy.descendant == ploidy.descendant)
+			return true;
+	}
+	return false;
+}
+
+void TetMAModel::set_float_screen(double prob_cut) {
+	m_float_screen = true;
+	m_prob_cut = prob_cut;
+}
+
+//Callers check the ploidy with ploidy_supported() first
+TetMAModel::TetMAModel(const ModelParams &params, Ploidy ploidy):
+	m_float_screen(false), m_prob_cut(0.0), m_rechecked(0) {
+	for(auto &model : PLOIDY_MODELS) {
+		if(model.ploidy.ancestor == ploidy.ancestor && model.ploidy.descendant == ploidy.descendant)
+			m_kernel.reset(model.make(params));
+	}
+	assert(m_kernel);
+}
+
+void TetMAModel::evaluate_double(const ModelBatch &batch, double *prob, double *prob_one) const {
+	if(batch.nsites > 0)
+		m_kernel->run(batch, prob, prob_one, nullptr);
+}
+
+void TetMAModel::evaluate(const ModelBatch &batch, double *prob, double *prob_one) const {
+	if(batch.nsites == 0)
+		return;
+	if(!m_float_screen) {
+		m_kernel->run(batch, prob, prob_one, nullptr);
+		return;
+	}
+	//Screen in float, then redo in double every site that could be written:
+	//anything within the margin of the cut-off or above it, and anything that
+	//under- or overflowed. So calls and printed values match a double run.
+	//Sites that aren't re-checked keep their float values, and prob_one can
+	//come out NaN in float when a mutation term underflows, so those values
+	//must not be written. (With several parameter sets, ModelSets works a
+	//written site out in double under every set.)
+	size_t n = batch.nsites;
+	vector<float> fprob(n), fprob_one(n), fanc(n);
+	m_kernel->run(batch, fprob.data(), fprob_one.data(), fanc.data());
+	double margin = max(1e-3, 0.01*m_prob_cut);
+	ModelBatch recheck(batch.nsamples, batch.capacity);
+	vector<size_t> sites;
+	for(size_t s = 0; s < n; ++s) {
+		prob[s] = fprob[s];
+		prob_one[s] = fprob_one[s];
+		bool ok = isfinite(fprob[s]) && fanc[s] > FLOAT_SCREEN_MIN;
+		if(!ok || fprob[s] >= m_prob_cut - margin) {
+			size_t site = recheck.add_site(batch.reference[s]);
+			for(size_t i = 0; i < batch.nsamples; ++i) {
+				for(int k : {0,1,2,3})
+					recheck.counts(i, k)[site] = batch.counts(i, k)[s];
+			}
+			sites.push_back(s);
+		}
+	}
+	if(sites.empty())
+		return;
+	vector<double> dprob(sites.size()), dprob_one(sites.size());
+	m_kernel->run(recheck, dprob.data(), dprob_one.data(), nullptr);
+	for(size_t i = 0; i < sites.size(); ++i) {
+		prob[sites[i]] = dprob[i];
+		prob_one[sites[i]] = dprob_one[i];
+	}
+	m_rechecked += sites.size();
+}
+
 // Uncommon and compile with this:
 // clang++ -std=c++11 -Ithird-party/bamtools/src/ -Lboost_progam_options model.cc
 //
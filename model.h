@@ -2,6 +2,9 @@
 #define model_H
 
 
+#include <atomic>
+#include <memory>
+#include <vector>
 #include "Eigen/Dense"
 
 using namespace std;
@@ -27,14 +30,103 @@ struct ModelInput{// Can probably stand to lose this, started out more complex..
     ReadDataVector all_reads;
 };
 
-typedef Eigen::Array4d HaploidProbs;
-typedef Eigen::Array<double, 16, 1> DiploidProbs;
-typedef Eigen::Array<double, 16, 4> MutationMatrix;
+//Genotypes are unordered sets of Ploidy alleles from ACGT
+template<int Ploidy> struct Genotypes;
+template<> struct Genotypes<1>{ static constexpr int count = 4; };
+template<> struct Genotypes<2>{ static constexpr int count = 10; };
 
+//Likelihoods over the genotypes of one sample, and from each ancestral
+//genotype to each descendant one
+template<int Ploidy>
+using GenotypeProbs = Eigen::Array<double, Genotypes<Ploidy>::count, 1>;
+template<int AncPloidy, int DescPloidy>
+using TransitionMatrix = Eigen::Array<double, Genotypes<AncPloidy>::count, Genotypes<DescPloidy>::count>;
 
+//The diploid genotypes: AA AC AG AT CC CG CT GG GT TT
+const int NUM_GENOTYPES = Genotypes<2>::count;
+extern const int GENOTYPE_ALLELES[NUM_GENOTYPES][2];
+
+typedef GenotypeProbs<1> HaploidProbs;
+typedef GenotypeProbs<2> DiploidProbs;
+typedef TransitionMatrix<2, 1> MutationMatrix;
+
+//Ancestor and descendant ploidy. The original design is a diploid ancestor
+//with haploid lines
+struct Ploidy{
+    int ancestor;
+    int descendant;
+};
+const Ploidy DEFAULT_PLOIDY = {2, 1};
+//Whether there's a model for this design
+bool ploidy_supported(Ploidy ploidy);
+
+
+double DirichletMultinomialLogProbability(double alphas[4], ReadData data);
+DiploidProbs DiploidPopulation(const ModelParams &params, int ref_allele);
 DiploidProbs DiploidSequencing(const ModelParams &params, int ref_allele, ReadData data); 
 double TetMAProbOneMutation(const ModelParams &params, const ModelInput site_data);
 double TetMAProbability(const ModelParams &params, const ModelInput site_data);
 
+const size_t MODEL_BATCH_SIZE = 256;
+
+//Read counts for a batch of sites, structure-of-arrays: the counts of one
+//base in one sample are contiguous across sites, so the model can work on
+//every site in the batch at once
+struct ModelBatch{
+	ModelBatch(size_t nsamples = 0, size_t capacity = MODEL_BATCH_SIZE);
+	//Start a new site (counts zeroed), returns its index
+	size_t add_site(uint16_t ref_allele);
+	uint16_t* counts(size_t sample, size_t base) { return &reads[(sample*4 + base)*capacity]; }
+	const uint16_t* counts(size_t sample, size_t base) const { return &reads[(sample*4 + base)*capacity]; }
+	bool full() const { return nsites == capacity; }
+	void clear() { nsites = 0; }
+
+	size_t nsamples;
+	size_t capacity;
+	size_t nsites;
+	vector<uint16_t> reference;
+	vector<uint16_t> reads;
+};
+
+//Runs of sites where every read is the reference base only differ in their
+//depths, which often repeat from one site to the next. compact gets one site
+//for each distinct (ref base, per-sample depths) among those, and every
+//other site as it is; site s of batch is site_of[s] in compact. False, with
+//compact left alone, when no site repeats, so batches without repeats aren't
+//copied
+bool compact_invariant(const ModelBatch &batch, ModelBatch &compact, vector<size_t> &site_of);
+
+//The batch model for one ploidy design, see PloidyModel in model.cc. Real
+//is what the scaled likelihoods are held in
+class PloidyKernel{
+	public:
+		virtual ~PloidyKernel() {}
+		virtual void run(const ModelBatch &batch, double *prob, double *prob_one, double *anc_total) const = 0;
+		virtual void run(const ModelBatch &batch, float *prob, float *prob_one, float *anc_total) const = 0;
+};
+
+//TetMAProbability and TetMAProbOneMutation for whole batches of sites, for
+//any supported ploidy. The mutation matrices, population priors and
+//Dirichlet-multinomial log terms only depend on the parameters, so they're
+//worked out once here. evaluate() is const, so one model can be shared
+//between threads.
+class TetMAModel{
+	public:
+		TetMAModel(const ModelParams &params, Ploidy ploidy = DEFAULT_PLOIDY);
+		void evaluate(const ModelBatch &batch, double *prob, double *prob_one) const;
+		//Screen sites in single precision. Only sites that might reach
+		//prob_cut are worked out again in double, so sites at or above the
+		//cut-off get exactly the values a double run gives them
+		void set_float_screen(double prob_cut);
+		//Always in double, screening or not
+		void evaluate_double(const ModelBatch &batch, double *prob, double *prob_one) const;
+		size_t rechecked() const { return m_rechecked; }
+	private:
+		unique_ptr<PloidyKernel> m_kernel;
+		bool m_float_screen;
+		double m_prob_cut;
+		mutable atomic<size_t> m_rechecked;
+};
+
 
 #endif
@@ -3,6 +3,12 @@
 #include <vector>
 #include <algorithm>
 #include <sstream>
+#include <cstring>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "parsers.h"
 
@@ -10,37 +16,196 @@
 using namespace std;
 using namespace BamTools;
 
-FastaReference::FastaReference(string ref_file_name){
-    ifstream ref_file (ref_file_name);
+FastaReference::FastaReference(string ref_file_name): m_data(nullptr), m_size(0){
+    int fd = open(ref_file_name.c_str(), O_RDONLY);
+    struct stat file_info;
+    if(fd < 0 || fstat(fd, &file_info) != 0){
+        cerr << "Error: can't open reference " << ref_file_name << endl;
+        return;
+    }
+    m_size = file_info.st_size;
+    void* mapped = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED){
+        cerr << "Error: can't map reference " << ref_file_name << endl;
+        return;
+    }
+    m_data = static_cast<const char*>(mapped);
+    string fai_path = ref_file_name + ".fai";
+    if(stat(fai_path.c_str(), &file_info) != 0){
+        if(!build_index(fai_path)){
+            cerr << "Error: can't write FASTA index " << fai_path << endl;
+        }
+    }
+    else if(!load_index(fai_path)){
+        cerr << "Error: malformed FASTA index " << fai_path << endl;
+        munmap(const_cast<char*>(m_data), m_size);
+        m_data = nullptr;
+    }
+}
+
+FastaReference::~FastaReference(){
+    if(m_data){
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+}
+
+void FastaReference::add_chromosome(const string& name, uint32_t length, uint64_t offset,
+                                    uint32_t line_bases, uint32_t line_width){
+    uint64_t cummulative_len = chromosomes.empty() ? 0 : chromosomes.back().end;
+    m_name_index[name] = chromosomes.size();
+    chromosomes.push_back(FastaReferenceData{ name, 
+                                              length, 
+                                              cummulative_len + length,
+                                              offset,
+                                              line_bases,
+                                              line_width
+                                             });
+}
+
+//.fai lines are: name, length, offset, bases per line, bytes per line
+bool FastaReference::load_index(const string& fai_path){
+    ifstream fai(fai_path);
     string L;
-    uint64_t cummulative_len = 0;
-    while( getline(ref_file, L)){
-        size_t i = 0;
-        string chrom;
-        for(; L[i] != '\t'; i++){
-            chrom.push_back(L[i]);
+    while(getline(fai, L)){
+        if(L.empty()){
+            continue;
+        }
+        const char* p = L.c_str();
+        const char* tab = strchr(p, '\t');
+        if(!tab){
+            return false;
+        }
+        string name(p, tab);
+        char* next;
+        uint64_t fields[4];
+        p = tab + 1;
+        for(int i = 0; i < 4; i++){
+            fields[i] = strtoull(p, &next, 10);
+            if(next == p){
+                return false;
+            }
+            p = next + 1;
+        }
+        //the last base, counting newlines, has to be inside the mapped file
+        uint64_t length = fields[0], offset = fields[1];
+        uint64_t line_bases = fields[2], line_width = fields[3];
+        if(line_bases == 0 || line_width < line_bases || offset > m_size){
+            return false;
+        }
+        if(length > 0){
+            uint64_t lines = (length - 1)/line_bases;
+            if(lines > (m_size - offset)/line_width ||
+               offset + lines*line_width + (length - 1)%line_bases >= m_size){
+                return false;
+            }
+        }
+        add_chromosome(name, fields[0], fields[1], fields[2], fields[3]);
+    }
+    return true;
+}
+
+//Same as samtools faidx: one pass over the mapped file
+bool FastaReference::build_index(const string& fai_path){
+    const char* p = m_data;
+    const char* end = m_data + m_size;
+    while(p < end){
+        if(*p != '>'){
+            p = static_cast<const char*>(memchr(p, '\n', end - p));
+            if(!p){
+                break;
+            }
+            p++;
+            continue;
         }
-        i += 1;
-        string s_len;
-        for (; L[i] !='\t'; i++){
-            s_len.push_back(L[i]);
+        const char* name_end = p + 1;
+        while(name_end < end && !isspace(*name_end)){
+            name_end++;
         }
-        uint32_t chrom_len = stoul(s_len);
-        cummulative_len += chrom_len;
-        chromosomes.push_back(FastaReferenceData{ chrom, 
-                                                  chrom_len, 
-                                                  cummulative_len
-                                                 });
+        string name(p + 1, name_end);
+        const char* line = static_cast<const char*>(memchr(name_end, '\n', end - name_end));
+        line = line ? line + 1 : end;
+        uint64_t offset = line - m_data;
+        uint32_t line_bases = 0;
+        uint32_t line_width = 0;
+        uint64_t length = 0;
+        while(line < end && *line != '>'){
+            const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+            const char* next = eol ? eol + 1 : end;
+            uint32_t bases = (eol ? eol : end) - line;
+            if(bases > 0 && line[bases-1] == '\r'){
+                bases--;
+            }
+            if(line_bases == 0){
+                line_bases = bases;
+                line_width = next - line;
+            }
+            length += bases;
+            line = next;
+        }
+        add_chromosome(name, length, offset, line_bases ? line_bases : 1, line_width ? line_width : 1);
+        p = line;
+    }
+    ofstream fai(fai_path);
+    for(auto& c: chromosomes){
+        fai << c.name << '\t' << c.length << '\t' << c.offset << '\t' 
+            << c.line_bases << '\t' << c.line_width << '\n';
     }
+    return static_cast<bool>(fai);
 }
     
 void FastaReference::get_ref_id(string search_name, int& chr_id){
-    auto it = find_if(chromosomes.begin(), chromosomes.end(),
-                     [&search_name](const FastaReferenceData& chrom){
-                        return chrom.name == search_name;
-                      });
-    int idx  = distance(chromosomes.begin(), it);
-    chr_id = idx;
+    auto it = m_name_index.find(search_name);
+    chr_id = (it == m_name_index.end()) ? chromosomes.size() : it->second;
+}
+
+//-1 if the sequence isn't in the reference
+int FastaReference::get_ref_id(const string& name) const{
+    auto it = m_name_index.find(name);
+    return (it == m_name_index.end()) ? -1 : it->second;
+}
+
+SequenceView FastaReference::sequence(int chr_id) const{
+    if(!m_data || chr_id < 0 || chr_id >= static_cast<int>(chromosomes.size())){
+        return SequenceView{ nullptr, 0, 1, 1 };
+    }
+    const FastaReferenceData& c = chromosomes[chr_id];
+    return SequenceView{ m_data + c.offset, c.length, c.line_bases, c.line_width };
+}
+
+bool FastaReference::GetBase(int chr_id, uint64_t pos, char& base) const{
+    SequenceView seq = sequence(chr_id);
+    if(pos >= seq.length){
+        return false;
+    }
+    base = seq[pos];
+    return true;
+}
+
+
+uint16_t SampleSet::add_sample(const string& name){
+    auto it = find(names.begin(), names.end(), name);
+    if(it != names.end()){
+        return distance(names.begin(), it);
+    }
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+int SampleSet::index(const BamAlignment& ali) const{
+    if(!files.empty() && !ali.Filename.empty()){
+        auto it = files.find(ali.Filename);
+        if(it != files.end()){
+            return it->second;
+        }
+    }
+    if(read_group(ali, m_tag)){
+        auto it = read_groups.find(m_tag);
+        if(it != read_groups.end()){
+            return it->second;
+        }
+    }
+    return -1;
 }
 
 
@@ -67,6 +232,29 @@ int BedFile::get_interval(BedInterval& current_interval){
     
 }
 
+//Regions in the samtools style: 'chr' (whole sequence) or 'chr:start-end'
+//with 0-based, half-open coordinates like the rest of our output
+bool parse_region(const string& region, BedInterval& interval){
+    size_t colon = region.rfind(':');
+    if(colon == string::npos){
+        interval = BedInterval{ region, 0, UINT64_MAX };
+        return !region.empty();
+    }
+    size_t dash = region.find('-', colon);
+    if(dash == string::npos){
+        return false;
+    }
+    try{
+        interval = BedInterval{ region.substr(0, colon),
+                                stoul(region.substr(colon + 1, dash - colon - 1)),
+                                stoul(region.substr(dash + 1)) };
+    }
+    catch(const exception&){
+        return false;
+    }
+    return interval.start < interval.end;
+}
+
 //
 //Helper functions for parsing data out of BAMs
 
@@ -102,18 +290,96 @@ uint16_t base_index(char b){
 //    return(-1); //TODO refactor this to  update sample in place
 //}
 
-bool include_site(PileupAlignment pileup, uint16_t map_cut, uint16_t qual_cut){
-    const BamAlignment *ali = &pileup.Alignment;
-    if(ali->MapQuality > map_cut){
-        uint16_t bqual = static_cast<short>(ali->Qualities[pileup.PositionInAlignment]) - 33;
-        if(bqual > qual_cut){
-            return(not (ali->IsDuplicate()) && not(ali->IsFailedQC()) && ali->IsPrimaryAlignment());
-        }
+//Read-level filters, applied once as reads come off the BAM so failing reads
+//never enter the pileup
+bool include_read(const BamAlignment& ali, uint16_t map_cut){
+    return ali.MapQuality > map_cut && 
+           not(ali.IsDuplicate()) && not(ali.IsFailedQC()) && ali.IsPrimaryAlignment();
+}
+
+//Base-level filter, for reads that passed include_read()
+bool include_site(const PileupAlignment& pileup, uint16_t qual_cut){
+    uint16_t bqual = base_quality(pileup.Alignment, pileup.PositionInAlignment);
+    return bqual > qual_cut;
+}
+
+// Layout of the character data in a BAM record: NUL-terminated read name,
+// 4 bytes per CIGAR op, 4-bit packed bases, raw (not +33) qualities, tags
+static const char BAM_BASE_LOOKUP[] = "=ACMGRSVTWYHKDBN";
+
+static inline size_t sequence_offset(const BamAlignment& ali){
+    const char* data = ali.GetCharData().data();
+    return strlen(data) + 1 + 4*ali.CigarData.size();
+}
+
+const char* read_name(const BamAlignment& ali){
+    return ali.GetCharData().data();
+}
+
+uint64_t read_name_hash(const BamAlignment& ali){
+    uint64_t h = 14695981039346656037ULL;
+    for(const char* name = read_name(ali); *name; name++){
+        h ^= static_cast<unsigned char>(*name);
+        h *= 1099511628211ULL;
     }
-    return false;
+    return h;
 }
 
+char query_base(const BamAlignment& ali, int pos){
+    const char* seq = ali.GetCharData().data() + sequence_offset(ali);
+    unsigned char packed = seq[pos / 2];
+    return BAM_BASE_LOOKUP[ (pos % 2 == 0) ? (packed >> 4) : (packed & 0x0f) ];
+}
+
+uint16_t base_quality(const BamAlignment& ali, int pos){
+    size_t offset = sequence_offset(ali) + (ali.Length + 1)/2;
+    return static_cast<unsigned char>(ali.GetCharData()[offset + pos]);
+}
+
+//Size in bytes of a tag's value, given its type, or 0 for types we can't skip
+static size_t tag_value_size(char type, const char* value){
+    switch(type){
+        case 'A':
+        case 'c':
+        case 'C':
+            return 1;
+        case 's':
+        case 'S':
+            return 2;
+        case 'i':
+        case 'I':
+        case 'f':
+            return 4;
+        case 'Z':
+        case 'H':
+            return strlen(value) + 1;
+        case 'B':{
+            uint32_t n;
+            memcpy(&n, value + 1, 4);
+            return 5 + n*tag_value_size(value[0], value + 5);
+        }
+        default:
+            return 0;
+    }
+}
 
+bool read_group(const BamAlignment& ali, string& rg){
+    const string& data = ali.GetCharData();
+    size_t i = sequence_offset(ali) + (ali.Length + 1)/2 + ali.Length;
+    while(i + 3 < data.size()){
+        const char* tag = data.data() + i;
+        size_t value_size = tag_value_size(tag[2], tag + 3);
+        if(tag[0] == 'R' && tag[1] == 'G' && tag[2] == 'Z'){
+            rg.assign(tag + 3);
+            return true;
+        }
+        if(value_size == 0){
+            return false;
+        }
+        i += 3 + value_size;
+    }
+    return false;
+}
 
 
 
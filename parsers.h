@@ -2,6 +2,7 @@
 #define parsers_H
 
 #include "utils/bamtools_pileup_engine.h"
+#include <fstream>
 #include <unordered_map>
 
 using namespace std;
@@ -9,10 +10,40 @@ using namespace std;
 //typedef vector< string > SampleNames;
 typedef unordered_map<string, uint16_t> SampleMap;
 
+//Sample indices for ReadDataVectors. A read belongs to a sample through its
+//RG tag, or (for BAMs holding a single sample) through the file it came from,
+//which MergedBamReader records in BamAlignment::Filename
+class SampleSet{
+    public:
+        vector<string> names;
+        SampleMap read_groups; // RG ID => sample index
+        SampleMap files;       // BAM path => sample index
+        size_t size() const { return names.size(); }
+        uint16_t add_sample(const string& name);
+        // -1 if the read can't be assigned to a sample
+        int index(const BamTools::BamAlignment& ali) const;
+    private:
+        mutable string m_tag;
+};
+
 struct FastaReferenceData{
     string name;
     uint32_t length; 
     uint64_t end; //endpoint relative to entire length of whole ref
+    uint64_t offset;     //byte offset of the first base in the FASTA file
+    uint32_t line_bases; //bases per line
+    uint32_t line_width; //bytes per line, including the newline
+};
+
+//Zero-copy view of one sequence in a memory-mapped FASTA
+struct SequenceView{
+    const char* data;
+    uint32_t length;
+    uint32_t line_bases;
+    uint32_t line_width;
+    char operator[](uint64_t pos) const {
+        return data[ (pos / line_bases) * line_width + pos % line_bases ];
+    }
 };
 
 struct BedInterval{
@@ -23,14 +54,30 @@ struct BedInterval{
 
 typedef vector<FastaReferenceData> FastaReferenceVector;
 
+//FASTA reference, memory-mapped and indexed from (or, if it's missing,
+//written to) <ref_file_name>.fai. Sequences are looked up by name in a hash
+//table and read straight out of the mapping, so opening a reference with
+//many scaffolds costs one pass over the .fai and switching scaffolds is free
 class FastaReference{
-        //string ref_file_name;
     public:
         FastaReference(string ref_file_name);
+        ~FastaReference();
+        bool good() const { return m_data != nullptr; }
         FastaReferenceVector chromosomes;
         void get_ref_id(string name, int& chr_id);
+        int get_ref_id(const string& name) const;
+        SequenceView sequence(int chr_id) const;
+        SequenceView sequence(const string& name) const { return sequence(get_ref_id(name)); }
+        bool GetBase(int chr_id, uint64_t pos, char& base) const;
     private:
-        ifstream ref_file;
+        FastaReference(const FastaReference&);
+        bool load_index(const string& fai_path);
+        bool build_index(const string& fai_path);
+        void add_chromosome(const string& name, uint32_t length, uint64_t offset,
+                            uint32_t line_bases, uint32_t line_width);
+        unordered_map<string, int> m_name_index;
+        const char* m_data;
+        size_t m_size;
 };
 
 class BedFile{
@@ -43,8 +90,20 @@ class BedFile{
 };
 //Helper functions
 
-bool include_site(BamTools::PileupAlignment pileup, uint16_t map_cut, uint16_t qual_cut);
+bool include_read(const BamTools::BamAlignment& ali, uint16_t map_cut);
+bool include_site(const BamTools::PileupAlignment& pileup, uint16_t qual_cut);
 uint16_t base_index(char b);
+bool parse_region(const string& region, BedInterval& interval);
+
+//Decoders for alignments read with GetNextAlignmentCore(). These pull single
+//fields out of the packed record instead of building every string member
+const char* read_name(const BamTools::BamAlignment& ali);
+char query_base(const BamTools::BamAlignment& ali, int pos);
+uint16_t base_quality(const BamTools::BamAlignment& ali, int pos);
+bool read_group(const BamTools::BamAlignment& ali, string& rg);
+//FNV-1a of the read name, so choices made on it are the same on every
+//platform and for both mates of a pair
+uint64_t read_name_hash(const BamTools::BamAlignment& ali);
 string get_sample(string& tag);
 //uint32_t find_sample_index(string, SampleNames);
 
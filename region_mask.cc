@@ -0,0 +1,123 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "region_mask.h"
+
+using namespace std;
+using namespace BamTools;
+
+RegionMask::RegionMask(const RefVector& references):
+    m_references(references), m_bits(references.size()), m_masked_bases(0){
+    for(size_t i = 0; i < references.size(); i++){
+        m_ref_ids[references[i].RefName] = i;
+    }
+}
+
+bool RegionMask::add_bed(const string& path){
+    ifstream bed(path);
+    if(!bed){
+        cerr << "Error: can't open mask " << path << endl;
+        return false;
+    }
+    string L;
+    while(getline(bed, L)){
+        if(L.empty() || L[0] == '#' || L.compare(0, 5, "track") == 0 || L.compare(0, 7, "browser") == 0){
+            continue;
+        }
+        istringstream fields(L);
+        string chr;
+        uint64_t start, end;
+        if(!(fields >> chr >> start >> end)){
+            cerr << "Error: can't read mask line '" << L << "' in " << path << endl;
+            return false;
+        }
+        auto id = m_ref_ids.find(chr);
+        if(id == m_ref_ids.end()){
+            continue;
+        }
+        uint64_t length = m_references[id->second].RefLength;
+        end = min(end, length);
+        if(start >= end){
+            continue;
+        }
+        vector<uint64_t>& bits = m_bits[id->second];
+        if(bits.empty()){
+            bits.assign((length + 63)/64, 0);
+        }
+        //partial words at either end, whole words in between
+        for(; start < end && start % 64 != 0; start++){
+            bits[start/64] |= uint64_t(1) << (start % 64);
+        }
+        for(; start + 64 <= end; start += 64){
+            bits[start/64] = ~uint64_t(0);
+        }
+        for(; start < end; start++){
+            bits[start/64] |= uint64_t(1) << (start % 64);
+        }
+    }
+    m_masked_bases = 0;
+    for(auto& bits: m_bits){
+        for(auto w: bits){
+            m_masked_bases += __builtin_popcountll(w);
+        }
+    }
+    return true;
+}
+
+uint64_t RegionMask::masked_until(int ref_id, uint64_t pos) const{
+    if(!masked(ref_id, pos)){
+        return pos;
+    }
+    const vector<uint64_t>& bits = m_bits[ref_id];
+    uint64_t length = m_references[ref_id].RefLength;
+    //set bits in the complement are unmasked positions
+    uint64_t open = ~bits[pos/64] >> (pos % 64);
+    if(open){
+        return min(length, pos + __builtin_ctzll(open));
+    }
+    for(size_t w = pos/64 + 1; w < bits.size(); w++){
+        if(~bits[w]){
+            return min(length, w*64 + __builtin_ctzll(~bits[w]));
+        }
+    }
+    return length;
+}
+
+vector<BedInterval> RegionMask::unmasked(const BedInterval& interval, uint64_t min_run) const{
+    vector<BedInterval> parts;
+    auto id = m_ref_ids.find(interval.chr);
+    if(id == m_ref_ids.end() || m_bits[id->second].empty()){
+        parts.push_back(interval);
+        return parts;
+    }
+    const vector<uint64_t>& bits = m_bits[id->second];
+    uint64_t end = min(interval.end, uint64_t(m_references[id->second].RefLength));
+    uint64_t start = interval.start;
+    uint64_t pos = start;
+    while(pos < end){
+        //next masked position, a word at a time
+        uint64_t word = bits[pos/64] >> (pos % 64);
+        if(!word){
+            pos = (pos/64 + 1)*64;
+            continue;
+        }
+        pos += __builtin_ctzll(word);
+        if(pos >= end){
+            break;
+        }
+        uint64_t run_end = masked_until(id->second, pos);
+        if(run_end - pos >= min_run){
+            if(pos > start){
+                parts.push_back(BedInterval{ interval.chr, start, pos });
+            }
+            start = run_end;
+        }
+        pos = run_end;
+    }
+    if(start < end){
+        parts.push_back(BedInterval{ interval.chr, start, end });
+    }
+    return parts;
+}
@@ -0,0 +1,50 @@
+#ifndef region_mask_H
+#define region_mask_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "api/BamAux.h"
+#include "parsers.h"
+
+using namespace std;
+
+//Masked runs at least this long are jumped over with the BAM index instead
+//of being read through
+const uint64_t MASK_JUMP_MIN = 16384;
+
+//--exclude: positions to leave out, from one or more BED files, kept as one
+//bitset per BAM reference sequence so a lookup is a shift and a mask. Only
+//sequences with something masked get a bitset, at one bit per base.
+class RegionMask{
+    public:
+        RegionMask(const BamTools::RefVector& references);
+        //Masks every interval in the file (0-based, half-open). Header and
+        //comment lines are skipped, as are sequences that aren't in the BAMs.
+        //False if the file can't be read
+        bool add_bed(const string& path);
+
+        bool masked(int ref_id, uint64_t pos) const{
+            if(ref_id < 0 || static_cast<size_t>(ref_id) >= m_bits.size()){
+                return false;
+            }
+            const vector<uint64_t>& bits = m_bits[ref_id];
+            return pos/64 < bits.size() && (bits[pos/64] >> (pos%64) & 1);
+        }
+        //First position at or after pos that isn't masked
+        uint64_t masked_until(int ref_id, uint64_t pos) const;
+        //The parts of interval left once masked runs of at least min_run are
+        //taken out (shorter runs are left for masked() to catch)
+        vector<BedInterval> unmasked(const BedInterval& interval, uint64_t min_run) const;
+        uint64_t masked_bases() const { return m_masked_bases; }
+
+    private:
+        BamTools::RefVector m_references;
+        map<string, int> m_ref_ids;
+        vector< vector<uint64_t> > m_bits;
+        uint64_t m_masked_bases;
+};
+
+#endif
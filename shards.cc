@@ -0,0 +1,376 @@
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <memory>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+
+#include "shards.h"
+#include "site_file.h"
+
+using namespace std;
+
+static bool file_exists(const string& path){
+    return ifstream(path).good();
+}
+
+void write_done_marker(const string& out, const vector<BedInterval>& regions){
+    if(regions.empty()){
+        return;
+    }
+    ofstream done(out + ".done");
+    done << "#accuMUlate done" << endl;
+    for(auto& r: regions){
+        done << r.chr << '\t' << r.start << '\t' << r.end << endl;
+    }
+}
+
+static bool read_done_marker(const string& out, vector<BedInterval>& regions){
+    ifstream done(out + ".done");
+    if(!done){
+        return false;
+    }
+    string L;
+    while(getline(done, L)){
+        if(L.empty() || L[0] == '#'){
+            continue;
+        }
+        stringstream fields(L);
+        BedInterval r;
+        fields >> r.chr >> r.start >> r.end;
+        regions.push_back(r);
+    }
+    return true;
+}
+
+bool read_manifest(const string& path, vector<Shard>& shards){
+    ifstream manifest(path);
+    if(!manifest){
+        cerr << "Error: can't open manifest " << path << endl;
+        return false;
+    }
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "" : path.substr(0, slash + 1);
+    auto resolve = [&](const string& p){
+        return (p.empty() || p == "-" || p[0] == '/') ? p : dir + p;
+    };
+    string L;
+    while(getline(manifest, L)){
+        stringstream fields(L);
+        Shard s;
+        if(!(fields >> s.bed) || s.bed[0] == '#'){
+            continue;
+        }
+        if(!(fields >> s.calls)){
+            cerr << "Error: manifest line '" << L << "' has no calls file" << endl;
+            return false;
+        }
+        fields >> s.denom;
+        s.bed = resolve(s.bed);
+        s.calls = resolve(s.calls);
+        s.denom = resolve(s.denom);
+        if(s.denom == "-"){
+            s.denom.clear();
+        }
+        if(!file_exists(s.bed)){
+            cerr << "Error: can't open " << s.bed << endl;
+            return false;
+        }
+        BedFile bed(s.bed);
+        BedInterval r;
+        while(bed.get_interval(r) == 0){
+            s.regions.push_back(r);
+        }
+        shards.push_back(s);
+    }
+    if(shards.empty()){
+        cerr << "Error: no shards in " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+static bool same_regions(const vector<BedInterval>& a, const vector<BedInterval>& b){
+    return a.size() == b.size() &&
+           equal(a.begin(), a.end(), b.begin(), [](const BedInterval& x, const BedInterval& y){
+               return x.chr == y.chr && x.start == y.start && x.end == y.end;
+           });
+}
+
+//Genome order of the contigs, put together from the order they come in
+//within each bed file, so shards can be listed in any order. Ties go to the
+//contig that turns up first in the manifest. False if the bed files disagree
+static bool contig_ranks(const vector<Shard>& shards, map<string, size_t>& ranks){
+    vector<string> contigs;
+    map<string, size_t> index;
+    vector< vector<size_t> > after;
+    vector<size_t> nbefore;
+    for(auto& s: shards){
+        size_t prev = SIZE_MAX;
+        for(auto& r: s.regions){
+            auto it = index.insert(make_pair(r.chr, contigs.size())).first;
+            if(it->second == contigs.size()){
+                contigs.push_back(r.chr);
+                after.push_back(vector<size_t>());
+                nbefore.push_back(0);
+            }
+            size_t c = it->second;
+            if(prev != SIZE_MAX && prev != c){
+                after[prev].push_back(c);
+                nbefore[c]++;
+            }
+            prev = c;
+        }
+    }
+    priority_queue<size_t, vector<size_t>, greater<size_t> > ready;
+    for(size_t c = 0; c < contigs.size(); c++){
+        if(nbefore[c] == 0){
+            ready.push(c);
+        }
+    }
+    ranks.clear();
+    while(!ready.empty()){
+        size_t c = ready.top();
+        ready.pop();
+        ranks[contigs[c]] = ranks.size();
+        for(size_t d: after[c]){
+            if(--nbefore[d] == 0){
+                ready.push(d);
+            }
+        }
+    }
+    if(ranks.size() != contigs.size()){
+        cerr << "Error: the bed files don't agree on the order of the contigs" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool check_shards(const vector<Shard>& shards){
+    bool ok = true;
+    for(size_t i = 0; i < shards.size(); i++){
+        const Shard& s = shards[i];
+        for(auto& out: {s.calls, s.denom}){
+            if(out.empty()){
+                continue;
+            }
+            vector<BedInterval> done;
+            if(!read_done_marker(out, done)){
+                cerr << "Error: shard " << i + 1 << " (" << s.bed << ") didn't finish: no "
+                     << out << ".done" << endl;
+                ok = false;
+            }
+            else if(!same_regions(done, s.regions)){
+                cerr << "Error: " << out << " was run on different intervals from "
+                     << s.bed << endl;
+                ok = false;
+            }
+        }
+    }
+
+    map<string, size_t> ranks;
+    if(!contig_ranks(shards, ranks)){
+        return false;
+    }
+    vector< tuple<size_t, uint64_t, uint64_t, size_t, size_t> > intervals;
+    for(size_t i = 0; i < shards.size(); i++){
+        for(size_t j = 0; j < shards[i].regions.size(); j++){
+            const BedInterval& r = shards[i].regions[j];
+            intervals.push_back(make_tuple(ranks[r.chr], r.start, r.end, i, j));
+        }
+    }
+    sort(intervals.begin(), intervals.end());
+    for(size_t k = 1; k < intervals.size(); k++){
+        auto& a = intervals[k - 1];
+        auto& b = intervals[k];
+        if(get<0>(a) == get<0>(b) && get<1>(b) < get<2>(a)){
+            cerr << "Error: " << shards[get<3>(a)].bed << " and " << shards[get<3>(b)].bed
+                 << " overlap at " << shards[get<3>(b)].regions[get<4>(b)].chr << ':'
+                 << get<1>(b) << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+
+//One shard's calls, tsv or binary, restricted to its intervals
+class ShardCalls{
+    public:
+        ShardCalls(const Shard& shard):
+            m_path(shard.calls), m_site_file(is_site_file(shard.calls)), m_line(0){
+            for(auto& r: shard.regions){
+                m_regions[r.chr].push_back(make_pair(r.start, r.end));
+            }
+            for(auto& r: m_regions){
+                sort(r.second.begin(), r.second.end());
+            }
+            if(m_site_file){
+                m_sites.reset(new SiteReader(shard.calls));
+                m_good = m_sites->good();
+            }
+            else{
+                m_tsv.open(shard.calls);
+                m_good = m_tsv.good();
+                if(!m_good){
+                    cerr << "Error: can't open " << shard.calls << endl;
+                }
+            }
+            m_dropped = 0;
+        }
+
+        bool good() const { return m_good; }
+        uint64_t dropped() const { return m_dropped; }
+
+        //The next call inside the shard's intervals
+        bool next(string& line, string& chr, uint64_t& pos){
+            while(read(line, chr, pos)){
+                if(in_regions(chr, pos)){
+                    return true;
+                }
+                m_dropped++;
+            }
+            return false;
+        }
+
+    private:
+        bool read(string& line, string& chr, uint64_t& pos){
+            if(m_site_file){
+                SiteRecord site;
+                if(!m_sites->next(site)){
+                    return false;
+                }
+                line = site_to_tsv(site);
+                chr = site.chr;
+                pos = site.pos;
+                return true;
+            }
+            while(getline(m_tsv, line)){
+                m_line++;
+                if(line.empty()){
+                    continue;
+                }
+                size_t tab = line.find('\t');
+                if(tab != string::npos && isdigit(line[tab + 1])){
+                    char* end;
+                    pos = strtoull(line.c_str() + tab + 1, &end, 10);
+                    if(*end == '\t' || *end == '\0'){
+                        chr = line.substr(0, tab);
+                        return true;
+                    }
+                }
+                cerr << "Error: " << m_path << ": bad line " << m_line << endl;
+                m_good = false;
+                return false;
+            }
+            return false;
+        }
+
+        bool in_regions(const string& chr, uint64_t pos) const{
+            auto it = m_regions.find(chr);
+            if(it == m_regions.end()){
+                return false;
+            }
+            auto r = upper_bound(it->second.begin(), it->second.end(), make_pair(pos, UINT64_MAX));
+            return r != it->second.begin() && pos < prev(r)->second;
+        }
+
+        string m_path;
+        bool m_site_file;
+        bool m_good;
+        uint64_t m_dropped;
+        uint64_t m_line;
+        ifstream m_tsv;
+        unique_ptr<SiteReader> m_sites;
+        map<string, vector< pair<uint64_t, uint64_t> > > m_regions;
+};
+
+bool merge_calls(const vector<Shard>& shards, ostream& out){
+    map<string, size_t> ranks;
+    if(!contig_ranks(shards, ranks)){
+        return false;
+    }
+    vector< unique_ptr<ShardCalls> > calls;
+    for(auto& s: shards){
+        calls.emplace_back(new ShardCalls(s));
+        if(!calls.back()->good()){
+            return false;
+        }
+    }
+
+    //(contig rank, position, shard) of every shard's next call
+    typedef tuple<size_t, uint64_t, size_t> Key;
+    priority_queue<Key, vector<Key>, greater<Key> > heap;
+    vector<string> lines(shards.size());
+    string chr;
+    uint64_t pos;
+    for(size_t i = 0; i < shards.size(); i++){
+        if(calls[i]->next(lines[i], chr, pos)){
+            heap.push(make_tuple(ranks[chr], pos, i));
+        }
+    }
+    while(!heap.empty()){
+        Key top = heap.top();
+        heap.pop();
+        size_t i = get<2>(top);
+        out << lines[i] << '\n';
+        if(calls[i]->next(lines[i], chr, pos)){
+            Key k = make_tuple(ranks[chr], pos, i);
+            if(k < top){
+                cerr << "Error: " << shards[i].calls << " isn't in the same contig order as the "
+                     << "bed files (at " << chr << ':' << pos << ")" << endl;
+                return false;
+            }
+            heap.push(k);
+        }
+    }
+    uint64_t dropped = 0;
+    for(auto& c: calls){
+        if(!c->good()){
+            return false;
+        }
+        dropped += c->dropped();
+    }
+    cerr << "merge: " << dropped << " calls outside their shard's intervals left out" << endl;
+    return true;
+}
+
+bool sum_denoms(const vector<Shard>& shards, ostream& out){
+    vector<uint64_t> total;
+    bool any = false;
+    for(auto& s: shards){
+        if(s.denom.empty()){
+            continue;
+        }
+        ifstream in(s.denom);
+        string L;
+        getline(in, L);
+        stringstream fields(L);
+        vector<uint64_t> row;
+        uint64_t v;
+        while(fields >> v){
+            row.push_back(v);
+        }
+        if(any && row.size() != total.size()){
+            cerr << "Error: " << s.denom << " has " << row.size() << " fields, expected "
+                 << total.size() << endl;
+            return false;
+        }
+        total.resize(row.size(), 0);
+        for(size_t j = 0; j < row.size(); j++){
+            total[j] += row[j];
+        }
+        any = true;
+    }
+    if(any){
+        for(auto v: total){
+            out << v << '\t';
+        }
+        out << endl;
+    }
+    return true;
+}
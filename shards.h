@@ -0,0 +1,49 @@
+#ifndef shards_H
+#define shards_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "parsers.h"
+
+using namespace std;
+
+// Runs split across nodes (see utils/split_beds.py) are put back together by
+// `accuMUlate merge`. Run on intervals (-i), accuMUlate and denom -o write
+// <out>.done when they finish, listing the intervals. A manifest names each
+// shard's bed file, calls and (optionally) denom output, one shard per line:
+//
+//     interval_1.bed  interval_1.tsv  interval_1.denom
+//
+// Relative paths are taken from the manifest's directory, '-' means no file
+// and lines starting with '#' are skipped.
+
+struct Shard{
+    string bed;
+    string calls;
+    string denom;
+    vector<BedInterval> regions;
+};
+
+// Marks out as complete, having covered regions. Whole-genome runs (no
+// regions) aren't shards, so get no marker
+void write_done_marker(const string& out, const vector<BedInterval>& regions);
+
+bool read_manifest(const string& path, vector<Shard>& shards);
+
+// Every output has a .done marker for exactly the shard's intervals, and no
+// two shards' intervals overlap. Problems are reported to cerr
+bool check_shards(const vector<Shard>& shards);
+
+// Streams the shards' tsv or binary calls into one tsv in genome order (the
+// order contigs come in within the bed files, whatever order the manifest
+// lists them in). Sites outside
+// their shard's intervals, from reads overlapping the edges, are left out so
+// each position comes from exactly one shard
+bool merge_calls(const vector<Shard>& shards, ostream& out);
+
+// Sums the denom rows, field by field
+bool sum_denoms(const vector<Shard>& shards, ostream& out);
+
+#endif
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <numeric>
+
+#include "site_data.h"
+#include "parsers.h"
+
+using namespace std;
+using namespace BamTools;
+
+SampleSiteData::SampleSiteData(){
+    MQ.key = 0;
+    BQ.key = 0;
+    fwd_reads.key = 0;
+    rev_reads.key = 0;
+    all_reads.key= 0;
+    depth = 0;
+}
+
+uint16_t SampleSiteData::get_genotype(){
+    //TODO: call genotypes from the model
+    //These have already been called for mutation-ness, and are haploid
+    //so, to make a start, we are just calling the most common base 
+    if (fwd_reads.key == 0 && rev_reads.key == 0){
+        return -1;
+    }
+    for(size_t i=0; i<4; i++){
+        int n = fwd_reads.reads[i] + rev_reads.reads[i];
+        all_reads.reads[i] += n;
+        depth += n;
+    }
+    return distance(all_reads.reads, max_element(all_reads.reads, all_reads.reads + 4));
+}
+
+void SampleSiteData::import_alignment(const BamAlignment& al, const int& pos, const int& bindex){
+    BQ.reads[bindex] += base_quality(al, pos);
+    MQ.reads[bindex] += (al.MapQuality);
+    if(al.IsReverseStrand()){ 
+        rev_reads.reads[bindex] += 1; 
+    } 
+    else{ 
+        fwd_reads.reads[bindex] += 1; 
+    }
+}
+
+
+ExperimentSiteData::ExperimentSiteData(vector<string> sn, string initial_data, char ref_base){
+    snames = sn;
+    m_initial_data = initial_data;
+    m_ref_base = ref_base;
+    //fill constructor doesn't work here?
+    for(size_t i= 0; i < sn.size(); i++){
+        sample_data.push_back(SampleSiteData());
+    }
+}
+
+void ExperimentSiteData::summarize(ostream* out_stream, ostream& log){
+
+    // call genotypes, keep track of each sample and number of each 
+    // possible allele
+    vector<uint16_t> genotypes;
+    ReadData gfreqs;
+    gfreqs.key = 0;
+    for(size_t i=0; i < sample_data.size(); i++){
+        uint16_t g = sample_data[i].get_genotype();
+        if(g < 4){//no data == npos
+            gfreqs.reads[g] += 1;
+        }
+        genotypes.push_back(g);             
+    }
+    //Now find the mutant (should be the only one with it's allele)
+    uint16_t mutant_base;
+    uint16_t n_mutant = 0;
+    for(size_t i = 0; i<4; i++){
+        if (gfreqs.reads[i] == 1){
+            n_mutant += 1;
+            mutant_base = i;
+        }
+    }
+    if (n_mutant != 1){
+        //Looks like messy data. Print out the read matrix so we can
+        //unerstand what going on, add an empty line to the output
+        *out_stream  << m_initial_data
+           << "\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\t" << endl;
+        log << "Skipping " << m_initial_data <<  endl;
+        log << "Read Matrix:" << endl;
+        for (size_t i=0; i < sample_data.size(); i++){
+            log << snames[i] << '\t';
+            for (size_t j=0; j<4; j++){
+                log << sample_data[i].all_reads.reads[j] << '\t';
+            }
+            log << endl;
+        }
+        return; // 
+    }
+    auto it = find_if(genotypes.begin(), genotypes.end(), [&](int v) {return v==mutant_base;});
+    uint32_t mutant = distance(genotypes.begin(), it);
+    
+    //summarise the data from the mutant strain
+    SampleSiteData * ms = &sample_data[mutant];
+    double f_mutant_m = ms->all_reads.reads[mutant_base]/(double)ms->depth;
+    uint16_t* F_m = &ms->fwd_reads.reads[mutant_base];
+    uint16_t* R_m = &ms->rev_reads.reads[mutant_base];
+    double m_MQs = ms->MQ.reads[mutant_base]/(double)ms->all_reads.reads[mutant_base];
+    double m_BQs = ms->BQ.reads[mutant_base]/(double)ms->all_reads.reads[mutant_base];
+
+    int other_MQs_sum = 0;
+    int other_BQs_sum = 0;
+    int Q_denom = 0;
+    for(size_t i = 0; i < 4; ++i){
+        if(i != mutant_base){
+            other_MQs_sum += ms->MQ.reads[i];
+            other_BQs_sum += ms->BQ.reads[i];
+            Q_denom += ms->all_reads.reads[i];
+        }
+    }
+    double other_MQs = other_MQs_sum/(double)Q_denom;
+    double other_BQs = other_BQs_sum/(double)Q_denom;
+
+    //and now the WT strains
+    int N_mutant_wt = 0; //mutant allele freq in strains with WT allel
+    int F_wt = 0;// n forward and reverse reads for rference base
+    int R_wt = 0;// in wildtype strains
+    int wt_MQs_sum = 0;
+    int wt_BQs_sum = 0;
+    int wt_depth = 0;
+
+    uint16_t ref_bindex  = base_index(m_ref_base);
+    for (size_t i=0; i < sample_data.size(); i++){
+        if (i != mutant){
+            SampleSiteData* s = &sample_data[i];
+            N_mutant_wt += s->all_reads.reads[mutant_base];
+
+            F_wt += s->fwd_reads.reads[ref_bindex];
+            R_wt += s->rev_reads.reads[ref_bindex];
+
+            wt_MQs_sum += accumulate(s->MQ.reads, s->MQ.reads + 4, 0);
+            wt_BQs_sum += accumulate(s->BQ.reads, s->BQ.reads + 4, 0);
+
+            wt_depth += s->depth;
+
+        }
+    }
+    double wt_MQs = wt_MQs_sum/(double)wt_depth;
+    double wt_BQs = wt_BQs_sum/(double)wt_depth;
+    double f_mutant_wt = N_mutant_wt/(double)wt_depth;
+
+    
+    *out_stream  << m_initial_data << '\t'
+                 << mutant_base << '\t'
+                 << snames[mutant] << '\t'
+                 << f_mutant_m << '\t'  //freq. of mutant base in mutant strain
+                 << f_mutant_wt << '\t' //freq. mutant base in WTs
+                 << *F_m << '\t' << *R_m << '\t' << F_wt << '\t' << R_wt << '\t'
+                 << m_BQs << '\t' << other_BQs << '\t' << wt_BQs << '\t'
+                 << m_MQs << '\t' << other_MQs << '\t' << wt_MQs << '\t'    
+                 << endl;
+}
@@ -0,0 +1,54 @@
+#ifndef site_data_H
+#define site_data_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "api/BamAlignment.h"
+#include "model.h"
+
+using namespace std;
+
+//Per-allele summaries of the reads at a candidate site: strand counts, base
+//and mapping quality sums. pp builds these from a second pass over the BAM;
+//accuMUlate --annotate fills them from its own pileup. Only reads with
+//mapping quality above ANNOTATE_MAPPING_QUAL and bases with quality above
+//ANNOTATE_BASE_QUAL count.
+const int ANNOTATE_BASE_QUAL = 13;
+const int ANNOTATE_MAPPING_QUAL = 30;
+
+class SampleSiteData{
+
+    public:
+        //These are 16bit unsigned ints - can handle 2^16/41 ~ 1600 quality
+        //scores without overflowing
+        ReadData fwd_reads;
+        ReadData rev_reads;
+        ReadData all_reads;
+        ReadData MQ;
+        ReadData BQ;
+        uint16_t depth;
+
+        SampleSiteData();
+        uint16_t get_genotype();
+        void import_alignment(const BamTools::BamAlignment& al, const int& pos, const int& bindex);
+};
+
+ 
+class ExperimentSiteData{
+    public:
+        string m_initial_data;
+        vector<SampleSiteData> sample_data;
+        vector<string> snames;
+        char m_ref_base;
+
+        ExperimentSiteData(vector<string> sn, string initial_data, char ref_base);
+        //Writes the initial data with pp's columns (mutant base and sample,
+        //allele frequencies, strand counts, mean BQs and MQs) appended. Sites
+        //that don't look like a single mutant are reported to log
+        void summarize(ostream* out_stream, ostream& log = cerr);
+};
+
+#endif
@@ -0,0 +1,211 @@
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+#include "site_file.h"
+
+using namespace std;
+
+static const char SITE_MAGIC[8] = {'A','C','M','S','I','T','E','1'};
+static const char SITE_INDEX_MAGIC[8] = {'A','C','M','S','I','D','X','1'};
+
+SiteWriter::SiteWriter(string file_name):
+    m_out(file_name, ios::binary), m_offset(0), m_current_contig(0), m_closed(false){
+    m_out.write(SITE_MAGIC, 8);
+    m_offset += 8;
+}
+
+SiteWriter::~SiteWriter(){
+    close();
+}
+
+void SiteWriter::add(const string& chr, uint64_t pos, char ref_base, double prob, double prob_one){
+    auto it = m_contig_ids.find(chr);
+    uint32_t contig;
+    if(it == m_contig_ids.end()){
+        contig = m_contigs.size();
+        m_contig_ids[chr] = contig;
+        m_contigs.push_back(chr);
+    }
+    else{
+        contig = it->second;
+    }
+    //Blocks never span contigs, and positions must increase within a block
+    if( !m_pos.empty() && (contig != m_current_contig || pos < m_pos.back()) ){
+        flush_block();
+    }
+    m_current_contig = contig;
+    m_pos.push_back(pos);
+    m_ref.push_back(ref_base);
+    m_prob.push_back(prob);
+    m_prob_one.push_back(prob_one);
+    if(m_pos.size() == SITE_BLOCK_SIZE){
+        flush_block();
+    }
+}
+
+void SiteWriter::flush_block(){
+    if(m_pos.empty()){
+        return;
+    }
+    ByteBuffer raw;
+    uint64_t last = m_pos.front();
+    for(auto p: m_pos){
+        put_varint(raw, p - last);
+        last = p;
+    }
+    raw.insert(raw.end(), m_ref.begin(), m_ref.end());
+    put_shuffled_doubles(raw, m_prob);
+    put_shuffled_doubles(raw, m_prob_one);
+    m_index.push_back(BlockInfo{ m_current_contig,
+                                     static_cast<uint32_t>(m_pos.size()),
+                                     m_pos.front(),
+                                     m_pos.back(),
+                                     m_offset });
+    m_offset += write_block(m_out, raw);
+    m_pos.clear();
+    m_ref.clear();
+    m_prob.clear();
+    m_prob_one.clear();
+}
+
+void SiteWriter::close(){
+    if(m_closed){
+        return;
+    }
+    flush_block();
+    write_block_index(m_out, m_offset, m_contigs, m_index, SITE_INDEX_MAGIC);
+    m_out.close();
+    m_closed = true;
+}
+
+
+SiteReader::SiteReader(string file_name):
+    m_in(file_name, ios::binary), m_good(false), m_block(0), m_row(0),
+    m_region_contig(-1), m_current_contig(0), m_start(0), m_end(0){
+    char magic[8];
+    if(!m_in.read(magic, 8) || memcmp(magic, SITE_MAGIC, 8) != 0){
+        cerr << "Error: " << file_name << " is not an accuMUlate site file" << endl;
+        return;
+    }
+    if(!read_block_index(m_in, m_contigs, m_index, SITE_INDEX_MAGIC)){
+        cerr << "Error: " << file_name << " has no block index (truncated?)" << endl;
+        return;
+    }
+    m_good = true;
+    clear_region();
+}
+
+void SiteReader::clear_region(){
+    m_region_contig = -1;
+    m_start = 0;
+    m_end = UINT64_MAX;
+    m_block = 0;
+    m_row = 0;
+    m_pos.clear();
+}
+
+bool SiteReader::set_region(const string& chr, uint64_t start, uint64_t end){
+    clear_region();
+    auto it = find(m_contigs.begin(), m_contigs.end(), chr);
+    if(it == m_contigs.end()){
+        m_block = m_index.size();
+        return false;
+    }
+    m_region_contig = distance(m_contigs.begin(), it);
+    m_start = start;
+    m_end = end;
+    return true;
+}
+
+bool SiteReader::block_in_region(const BlockInfo& b) const{
+    if(m_region_contig < 0){
+        return true;
+    }
+    return b.contig == static_cast<uint32_t>(m_region_contig) &&
+           b.last_pos >= m_start && b.first_pos < m_end;
+}
+
+bool SiteReader::load_block(size_t block){
+    const BlockInfo& b = m_index[block];
+    m_in.clear();
+    m_in.seekg(b.offset);
+    ByteBuffer raw;
+    if(!read_block(m_in, raw)){
+        cerr << "Error: corrupt block in site file" << endl;
+        return false;
+    }
+    size_t offset = 0;
+    m_pos.resize(b.nsites);
+    uint64_t last = b.first_pos;
+    bool ok = true;
+    for(uint32_t i = 0; ok && i < b.nsites; i++){
+        uint64_t delta;
+        ok = get_varint(raw, offset, delta);
+        last += delta;
+        m_pos[i] = last;
+    }
+    ok = ok && offset + b.nsites <= raw.size();
+    if(ok){
+        m_ref.assign(raw.begin() + offset, raw.begin() + offset + b.nsites);
+        offset += b.nsites;
+    }
+    ok = ok && get_shuffled_doubles(raw, offset, b.nsites, m_prob) &&
+               get_shuffled_doubles(raw, offset, b.nsites, m_prob_one);
+    if(!ok){
+        cerr << "Error: corrupt block in site file" << endl;
+        m_pos.clear();
+    }
+    return ok;
+}
+
+bool SiteReader::next(SiteRecord& site){
+    if(!m_good){
+        return false;
+    }
+    while(true){
+        if(m_row >= m_pos.size()){
+            //find the next block that overlaps the region
+            while(m_block < m_index.size() && !block_in_region(m_index[m_block])){
+                m_block++;
+            }
+            if(m_block >= m_index.size()){
+                return false;
+            }
+            if(!load_block(m_block)){
+                m_good = false;
+                return false;
+            }
+            m_current_contig = m_index[m_block].contig;
+            m_block++;
+            m_row = 0;
+        }
+        size_t i = m_row++;
+        if(m_pos[i] < m_start || m_pos[i] >= m_end){
+            continue;
+        }
+        site.chr = m_contigs[m_current_contig];
+        site.pos = m_pos[i];
+        site.ref_base = m_ref[i];
+        site.prob = m_prob[i];
+        site.prob_one = m_prob_one[i];
+        return true;
+    }
+}
+
+bool is_site_file(const string& file_name){
+    ifstream in(file_name, ios::binary);
+    char magic[8];
+    return in.read(magic, 8) && memcmp(magic, SITE_MAGIC, 8) == 0;
+}
+
+string site_to_tsv(const SiteRecord& site){
+    stringstream line;
+    line << site.chr << '\t'
+         << site.pos << '\t'
+         << site.ref_base << '\t'
+         << site.prob << '\t'
+         << site.prob_one << '\t';
+    return line.str();
+}
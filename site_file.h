@@ -0,0 +1,87 @@
+#ifndef site_file_H
+#define site_file_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+
+#include "block_io.h"
+
+using namespace std;
+
+// Binary alternative to the tab-separated caller output. Sites are stored in
+// blocks of (at most) SITE_BLOCK_SIZE records from a single contig, each
+// block holding delta-coded positions, reference bases and byte-shuffled
+// probabilities, deflated. An index of every block (contig, first/last
+// position, file offset) sits at the end of the file, so readers can jump
+// straight to a region.
+
+const uint32_t SITE_BLOCK_SIZE = 4096;
+
+struct SiteRecord{
+    string chr;
+    uint64_t pos;
+    char ref_base;
+    double prob;
+    double prob_one;
+};
+
+class SiteWriter{
+    public:
+        SiteWriter(string file_name);
+        ~SiteWriter();
+        //False if the file couldn't be opened (or written to)
+        bool good() const { return m_out.good(); }
+        void add(const string& chr, uint64_t pos, char ref_base, double prob, double prob_one);
+        void close();
+    private:
+        void flush_block();
+        ofstream m_out;
+        uint64_t m_offset;
+        vector<string> m_contigs;
+        unordered_map<string, uint32_t> m_contig_ids;
+        vector<BlockInfo> m_index;
+        uint32_t m_current_contig;
+        vector<uint64_t> m_pos;
+        vector<char> m_ref;
+        vector<double> m_prob;
+        vector<double> m_prob_one;
+        bool m_closed;
+};
+
+class SiteReader{
+    public:
+        SiteReader(string file_name);
+        bool good() const { return m_good; }
+        const vector<string>& contigs() const { return m_contigs; }
+        // Restrict iteration to [start, end) on chr. Returns false if chr
+        // isn't in the file
+        bool set_region(const string& chr, uint64_t start, uint64_t end);
+        void clear_region();
+        bool next(SiteRecord& site);
+    private:
+        bool load_block(size_t block);
+        bool block_in_region(const BlockInfo& b) const;
+        ifstream m_in;
+        bool m_good;
+        vector<string> m_contigs;
+        vector<BlockInfo> m_index;
+        size_t m_block;
+        size_t m_row;
+        int64_t m_region_contig;
+        uint32_t m_current_contig;
+        uint64_t m_start;
+        uint64_t m_end;
+        vector<uint64_t> m_pos;
+        vector<char> m_ref;
+        vector<double> m_prob;
+        vector<double> m_prob_one;
+};
+
+bool is_site_file(const string& file_name);
+// Same line (minus newline) the caller writes in tsv mode
+string site_to_tsv(const SiteRecord& site);
+
+#endif
@@ -103,6 +103,11 @@ struct API_EXPORT BamAlignment {
         // calculates alignment end position
         int GetEndPosition(bool usePadded = false, bool closedInterval = false) const;
 
+        // returns the raw, undecoded name/CIGAR/sequence/quality/tag data
+        // (lets callers of BamReader::GetNextAlignmentCore() read single fields
+        //  without populating all the string members)
+        const std::string& GetCharData(void) const { return SupportData.AllCharData; }
+
         // returns a description of the last error that occurred
         std::string GetErrorString(void) const;
 
@@ -2,7 +2,7 @@
 // BamReader.cpp (c) 2009 Derek Barnett, Michael Str�mberg
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 29 July 2013 (DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides read access to BAM files.
 // ***************************************************************************
@@ -61,6 +61,21 @@ bool BamReader::CreateIndex(const BamIndex::IndexType& type) {
     return d->CreateIndex(type);
 }
 
+/*! \fn void BamReader::GetBlockCacheStats(uint64_t& hits, uint64_t& misses) const
+    \brief Retrieves hit & miss counts for the inflated-block cache.
+
+    Every BGZF block read while the cache is enabled counts as either a hit
+    (found in the cache) or a miss (read & inflated from the file). Counts
+    are kept across Open() calls.
+
+    \param[out] hits   number of blocks loaded from the cache
+    \param[out] misses number of blocks read from the file
+    \sa SetBlockCacheSize()
+*/
+void BamReader::GetBlockCacheStats(uint64_t& hits, uint64_t& misses) const {
+    d->GetBlockCacheStats(hits, misses);
+}
+
 /*! \fn const SamHeader& BamReader::GetConstSamHeader(void) const
     \brief Returns const reference to SAM header data.
 
@@ -304,6 +319,21 @@ bool BamReader::Rewind(void) {
     return d->Rewind();
 }
 
+/*! \fn void BamReader::SetBlockCacheSize(size_t bytes)
+    \brief Sets the memory budget for caching inflated BGZF blocks.
+
+    Blocks are kept, least recently used first out, so that jumping back
+    into a block that has already been read (e.g. with many small
+    SetRegion() calls over nearby positions) copies it from memory instead
+    of reading & inflating it again. The cache is disabled by default.
+
+    \param[in] bytes memory budget in bytes (0 disables the cache)
+    \sa GetBlockCacheStats()
+*/
+void BamReader::SetBlockCacheSize(size_t bytes) {
+    d->SetBlockCacheSize(bytes);
+}
+
 /*! \fn void BamReader::SetIndex(BamIndex* index)
     \brief Sets a custom BamIndex on this reader.
 
@@ -2,7 +2,7 @@
 // BamReader.h (c) 2009 Derek Barnett, Michael Str�mberg
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 18 November 2012 (DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides read access to BAM files.
 // ***************************************************************************
@@ -56,6 +56,15 @@ class API_EXPORT BamReader {
                        const int& rightRefID,
                        const int& rightPosition);
 
+        // ----------------------
+        // block cache
+        // ----------------------
+
+        // retrieves hit & miss counts for the inflated-block cache
+        void GetBlockCacheStats(uint64_t& hits, uint64_t& misses) const;
+        // sets memory budget (bytes) for caching inflated BGZF blocks (0 disables)
+        void SetBlockCacheSize(size_t bytes);
+
         // ----------------------
         // access alignment data
         // ----------------------
@@ -2,7 +2,7 @@
 // BamReader_p.cpp (c) 2009 Derek Barnett
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 18 November 2012 (DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides the basic functionality for reading BAM files
 // ***************************************************************************
@@ -94,6 +94,10 @@ const string BamReaderPrivate::Filename(void) const {
     return m_filename;
 }
 
+void BamReaderPrivate::GetBlockCacheStats(uint64_t& hits, uint64_t& misses) const {
+    m_stream.GetBlockCacheStats(hits, misses);
+}
+
 const SamHeader& BamReaderPrivate::GetConstSamHeader(void) const {
     return m_header.ToConstSamHeader();
 }
@@ -442,6 +446,10 @@ bool BamReaderPrivate::Seek(const int64_t& position) {
     }
 }
 
+void BamReaderPrivate::SetBlockCacheSize(const size_t& bytes) {
+    m_stream.SetBlockCacheSize(bytes);
+}
+
 void BamReaderPrivate::SetErrorString(const string& where, const string& what) {
     static const string SEPARATOR = ": ";
     m_errorString = where + SEPARATOR + what;
@@ -2,7 +2,7 @@
 // BamReader_p.h (c) 2010 Derek Barnett
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 18 November 2012 (DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides the basic functionality for reading BAM files
 // ***************************************************************************
@@ -54,6 +54,10 @@ class BamReaderPrivate {
         bool GetNextAlignment(BamAlignment& alignment);
         bool GetNextAlignmentCore(BamAlignment& alignment);
 
+        // block cache
+        void GetBlockCacheStats(uint64_t& hits, uint64_t& misses) const;
+        void SetBlockCacheSize(const size_t& bytes);
+
         // access auxiliary data
         std::string GetHeaderText(void) const;
         const SamHeader& GetConstSamHeader(void) const;
@@ -2,7 +2,7 @@
 // BamStandardIndex.cpp (c) 2010 Derek Barnett
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 25 May 2012 (DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides index operations for the standardized BAM index format (".bai")
 // ***************************************************************************
@@ -112,82 +112,47 @@ void BamStandardIndex::CalculateCandidateBins(const uint32_t& begin,
     for (k = 4681 + (begin>>14); k <= 4681 + (end>>14); ++k) { candidateBins.insert(k); }
 }
 
-void BamStandardIndex::CalculateCandidateOffsets(const BaiReferenceSummary& refSummary,
+void BamStandardIndex::CalculateCandidateOffsets(const BaiReferenceData& refData,
                                                  const uint64_t& minOffset,
                                                  set<uint16_t>& candidateBins,
                                                  vector<int64_t>& offsets)
 {
-    // seek to first bin
-    Seek(refSummary.FirstBinFilePosition, SEEK_SET);
-
-    // iterate over reference bins
-    uint32_t binId;
-    int32_t numAlignmentChunks;
-    set<uint16_t>::iterator candidateBinIter;
-    for ( int i = 0; i < refSummary.NumBins; ++i ) {
-
-        // read bin contents (if successful, alignment chunks are now in m_buffer)
-        ReadBinIntoBuffer(binId, numAlignmentChunks);
-
-        // see if bin is a 'candidate bin'
-        candidateBinIter = candidateBins.find(binId);
-
-        // if not, move on to next bin
-        if ( candidateBinIter == candidateBins.end() )
+    // look up each candidate bin in the (sorted) in-memory bin list
+    set<uint16_t>::const_iterator candidateBinIter = candidateBins.begin();
+    set<uint16_t>::const_iterator candidateBinEnd  = candidateBins.end();
+    for ( ; candidateBinIter != candidateBinEnd; ++candidateBinIter ) {
+
+        vector<uint32_t>::const_iterator binIter = lower_bound(refData.BinIds.begin(),
+                                                               refData.BinIds.end(),
+                                                               (uint32_t)(*candidateBinIter));
+        if ( binIter == refData.BinIds.end() || *binIter != *candidateBinIter )
             continue;
 
-        // otherwise, check bin's contents against for overlap
-        else {
-
-            size_t offset = 0;
-            uint64_t chunkStart;
-            uint64_t chunkStop;
-
-            // iterate over alignment chunks
-            for ( int j = 0; j < numAlignmentChunks; ++j ) {
-
-                // read chunk start & stop from buffer
-                memcpy((char*)&chunkStart, m_resources.Buffer+offset, sizeof(uint64_t));
-                offset += sizeof(uint64_t);
-                memcpy((char*)&chunkStop, m_resources.Buffer+offset, sizeof(uint64_t));
-                offset += sizeof(uint64_t);
-
-                // swap endian-ness if necessary
-                if ( m_isBigEndian ) {
-                    SwapEndian_64(chunkStart);
-                    SwapEndian_64(chunkStop);
-                }
-
-                // store alignment chunk's start offset
-                // if its stop offset is larger than our 'minOffset'
-                if ( chunkStop >= minOffset )
-                    offsets.push_back(chunkStart);
-            }
-
-            // 'pop' bin ID from candidate bins set
-            candidateBins.erase(candidateBinIter);
-
-            // quit if no more candidates
-            if ( candidateBins.empty() )
-                break;
+        // store alignment chunk's start offset
+        // if its stop offset is larger than our 'minOffset'
+        const size_t binIndex = binIter - refData.BinIds.begin();
+        for ( uint32_t j = refData.BinChunkStart[binIndex]; j < refData.BinChunkStart[binIndex+1]; ++j ) {
+            const BaiAlignmentChunk& chunk = refData.Chunks[j];
+            if ( chunk.Stop >= minOffset )
+                offsets.push_back(chunk.Start);
         }
     }
 }
 
-uint64_t BamStandardIndex::CalculateMinOffset(const BaiReferenceSummary& refSummary,
+uint64_t BamStandardIndex::CalculateMinOffset(const BaiReferenceData& refData,
                                               const uint32_t& begin)
 {
     // if no linear offsets exist, return 0
-    if ( refSummary.NumLinearOffsets == 0 )
+    if ( refData.LinearOffsets.empty() )
         return 0;
 
     // if 'begin' starts beyond last linear offset, use the last linear offset as minimum
     // else use the offset corresponding to the requested start position
-    const int shiftedBegin = begin>>BamStandardIndex::BAM_LIDX_SHIFT;
-    if ( shiftedBegin >= refSummary.NumLinearOffsets )
-        return LookupLinearOffset( refSummary, refSummary.NumLinearOffsets-1 );
+    const size_t shiftedBegin = begin>>BamStandardIndex::BAM_LIDX_SHIFT;
+    if ( shiftedBegin >= refData.LinearOffsets.size() )
+        return refData.LinearOffsets.back();
     else
-        return LookupLinearOffset( refSummary, shiftedBegin );
+        return refData.LinearOffsets[shiftedBegin];
 }
 
 void BamStandardIndex::CheckBufferSize(char*& buffer,
@@ -252,8 +217,9 @@ void BamStandardIndex::CloseFile(void) {
         m_resources.Device = 0;
     }
 
-    // clear index file summary data
+    // clear index file summary & in-memory index data
     m_indexFileSummary.clear();
+    m_indexData.clear();
 
     // clean up I/O buffer
     delete[] m_resources.Buffer;
@@ -430,8 +396,8 @@ void BamStandardIndex::GetOffset(const BamRegion& region, int64_t& offset, bool*
     if ( region.LeftRefID < 0 || region.LeftRefID >= (int)m_indexFileSummary.size() )
         throw BamException("BamStandardIndex::GetOffset", "invalid reference ID requested");
 
-    // retrieve index summary for left bound reference
-    const BaiReferenceSummary& refSummary = m_indexFileSummary.at(region.LeftRefID);
+    // retrieve index data for left bound reference
+    const BaiReferenceData& refData = m_indexData.at(region.LeftRefID);
 
     // set up region boundaries based on actual BamReader data
     uint32_t begin;
@@ -444,12 +410,12 @@ void BamStandardIndex::GetOffset(const BamRegion& region, int64_t& offset, bool*
 
     // use reference's linear offsets to calculate the minimum offset
     // that must be considered to find overlap
-    const uint64_t& minOffset = CalculateMinOffset(refSummary, begin);
+    const uint64_t& minOffset = CalculateMinOffset(refData, begin);
 
     // attempt to use reference summary, minOffset, & candidateBins to calculate offsets
     // no data should not be error, just bail
     vector<int64_t> offsets;
-    CalculateCandidateOffsets(refSummary, minOffset, candidateBins, offsets);
+    CalculateCandidateOffsets(refData, minOffset, candidateBins, offsets);
     if ( offsets.empty() )
         return;
     
@@ -551,7 +517,7 @@ bool BamStandardIndex::Load(const std::string& filename) {
         // validate format
         CheckMagicNumber();
 
-        // load in-memory summary of index data
+        // load summary & all bins/linear offsets into memory
         SummarizeIndexFile();
 
         // return success
@@ -563,19 +529,6 @@ bool BamStandardIndex::Load(const std::string& filename) {
     }
 }
 
-uint64_t BamStandardIndex::LookupLinearOffset(const BaiReferenceSummary& refSummary, const int& index) {
-
-    // attempt seek to proper index file position
-    const int64_t linearOffsetFilePosition = (int64_t)refSummary.FirstLinearOffsetFilePosition +
-                                             index*BamStandardIndex::SIZEOF_LINEAROFFSET;
-    Seek(linearOffsetFilePosition, SEEK_SET);
-
-    // read linear offset from BAI file
-    uint64_t linearOffset;
-    ReadLinearOffset(linearOffset);
-    return linearOffset;
-}
-
 void BamStandardIndex::MergeAlignmentChunks(BaiAlignmentChunkVector& chunks) {
 
     // skip if chunks are empty, nothing to merge
@@ -707,6 +660,8 @@ void BamStandardIndex::ReadNumReferences(int& numReferences) {
 void BamStandardIndex::ReserveForSummary(const int& numReferences) {
     m_indexFileSummary.clear();
     m_indexFileSummary.assign( numReferences, BaiReferenceSummary() );
+    m_indexData.clear();
+    m_indexData.assign( numReferences, BaiReferenceData() );
 }
 
 void BamStandardIndex::SaveAlignmentChunkToBin(BaiBinMap& binMap,
@@ -772,23 +727,30 @@ void BamStandardIndex::Seek(const int64_t& position, const int origin) {
         throw BamException("BamStandardIndex::Seek", "could not seek in BAI file");
 }
 
-void BamStandardIndex::SkipBins(const int& numBins) {
-    uint32_t binId;
-    int32_t numAlignmentChunks;
-    for (int i = 0; i < numBins; ++i)
-        ReadBinIntoBuffer(binId, numAlignmentChunks); // results & buffer ignored
+void BamStandardIndex::SortLinearOffsets(BaiLinearOffsetVector& linearOffsets) {
+    sort( linearOffsets.begin(), linearOffsets.end() );
 }
 
-void BamStandardIndex::SkipLinearOffsets(const int& numLinearOffsets) {
-    const unsigned int bytesRequested = numLinearOffsets*BamStandardIndex::SIZEOF_LINEAROFFSET;
-    ReadIntoBuffer(bytesRequested);
-}
+void BamStandardIndex::StoreReferenceData(const BaiReferenceEntry& refEntry) {
 
-void BamStandardIndex::SortLinearOffsets(BaiLinearOffsetVector& linearOffsets) {
-    sort( linearOffsets.begin(), linearOffsets.end() );
+    // keep a copy of a freshly built reference entry, so a newly created index
+    // can be used for region queries right away
+    BaiReferenceData& refData = m_indexData.at(refEntry.ID);
+    refData = BaiReferenceData();
+
+    // BaiBinMap is already sorted by bin ID
+    BaiBinMap::const_iterator binIter = refEntry.Bins.begin();
+    BaiBinMap::const_iterator binEnd  = refEntry.Bins.end();
+    for ( ; binIter != binEnd; ++binIter ) {
+        refData.BinIds.push_back( (*binIter).first );
+        refData.BinChunkStart.push_back( refData.Chunks.size() );
+        refData.Chunks.insert( refData.Chunks.end(), (*binIter).second.begin(), (*binIter).second.end() );
+    }
+    refData.BinChunkStart.push_back( refData.Chunks.size() );
+    refData.LinearOffsets = refEntry.LinearOffsets;
 }
 
-void BamStandardIndex::SummarizeBins(BaiReferenceSummary& refSummary) {
+void BamStandardIndex::SummarizeBins(BaiReferenceSummary& refSummary, BaiReferenceData& refData) {
 
     // load number of bins
     int numBins;
@@ -798,8 +760,42 @@ void BamStandardIndex::SummarizeBins(BaiReferenceSummary& refSummary) {
     refSummary.NumBins = numBins;
     refSummary.FirstBinFilePosition = Tell();
 
-    // skip this reference's bins
-    SkipBins(numBins);
+    // read this reference's bins (BAI files need not list them in order)
+    BaiBinMap bins;
+    uint32_t binId;
+    int32_t numAlignmentChunks;
+    for ( int i = 0; i < numBins; ++i ) {
+        ReadBinIntoBuffer(binId, numAlignmentChunks);
+        BaiAlignmentChunkVector& chunks = bins[binId];
+        chunks.reserve(numAlignmentChunks);
+
+        size_t offset = 0;
+        uint64_t chunkStart;
+        uint64_t chunkStop;
+        for ( int j = 0; j < numAlignmentChunks; ++j ) {
+            memcpy((char*)&chunkStart, m_resources.Buffer+offset, sizeof(uint64_t));
+            offset += sizeof(uint64_t);
+            memcpy((char*)&chunkStop, m_resources.Buffer+offset, sizeof(uint64_t));
+            offset += sizeof(uint64_t);
+            if ( m_isBigEndian ) {
+                SwapEndian_64(chunkStart);
+                SwapEndian_64(chunkStop);
+            }
+            chunks.push_back( BaiAlignmentChunk(chunkStart, chunkStop) );
+        }
+    }
+
+    // flatten into sorted, compact arrays
+    refData.BinIds.reserve(bins.size());
+    refData.BinChunkStart.reserve(bins.size() + 1);
+    BaiBinMap::const_iterator binIter = bins.begin();
+    BaiBinMap::const_iterator binEnd  = bins.end();
+    for ( ; binIter != binEnd; ++binIter ) {
+        refData.BinIds.push_back( (*binIter).first );
+        refData.BinChunkStart.push_back( refData.Chunks.size() );
+        refData.Chunks.insert( refData.Chunks.end(), (*binIter).second.begin(), (*binIter).second.end() );
+    }
+    refData.BinChunkStart.push_back( refData.Chunks.size() );
 }
 
 void BamStandardIndex::SummarizeIndexFile(void) {
@@ -815,10 +811,10 @@ void BamStandardIndex::SummarizeIndexFile(void) {
     BaiFileSummary::iterator summaryIter = m_indexFileSummary.begin();
     BaiFileSummary::iterator summaryEnd  = m_indexFileSummary.end();
     for ( int i = 0; summaryIter != summaryEnd; ++summaryIter, ++i )
-        SummarizeReference(*summaryIter);
+        SummarizeReference(*summaryIter, m_indexData[i]);
 }
 
-void BamStandardIndex::SummarizeLinearOffsets(BaiReferenceSummary& refSummary) {
+void BamStandardIndex::SummarizeLinearOffsets(BaiReferenceSummary& refSummary, BaiReferenceData& refData) {
 
     // load number of linear offsets
     int numLinearOffsets;
@@ -828,13 +824,15 @@ void BamStandardIndex::SummarizeLinearOffsets(BaiReferenceSummary& refSummary) {
     refSummary.NumLinearOffsets = numLinearOffsets;
     refSummary.FirstLinearOffsetFilePosition = Tell();
 
-    // skip linear offsets in index file
-    SkipLinearOffsets(numLinearOffsets);
+    // read linear offsets into memory
+    refData.LinearOffsets.resize(numLinearOffsets);
+    for ( int i = 0; i < numLinearOffsets; ++i )
+        ReadLinearOffset(refData.LinearOffsets[i]);
 }
 
-void BamStandardIndex::SummarizeReference(BaiReferenceSummary& refSummary) {
-    SummarizeBins(refSummary);
-    SummarizeLinearOffsets(refSummary);
+void BamStandardIndex::SummarizeReference(BaiReferenceSummary& refSummary, BaiReferenceData& refData) {
+    SummarizeBins(refSummary, refData);
+    SummarizeLinearOffsets(refSummary, refData);
 }
 
 // return position of file pointer in index file stream
@@ -962,4 +960,5 @@ void BamStandardIndex::WriteLinearOffsets(const int& refId, BaiLinearOffsetVecto
 void BamStandardIndex::WriteReferenceEntry(BaiReferenceEntry& refEntry) {
     WriteBins(refEntry.ID, refEntry.Bins);
     WriteLinearOffsets(refEntry.ID, refEntry.LinearOffsets);
+    StoreReferenceData(refEntry);
 }
@@ -2,7 +2,7 @@
 // BamStandardIndex.h (c) 2010 Derek Barnett
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 10 November 2011 (DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides index operations for the standardized BAM index format (".bai")
 // ***************************************************************************
@@ -100,6 +100,20 @@ struct BaiReferenceSummary {
 // convenience typedef for describing a full BAI index file summary
 typedef std::vector<BaiReferenceSummary> BaiFileSummary;
 
+// in-memory copy of a reference's bins & linear offsets, loaded once so that
+// region lookups never go back to the index file
+struct BaiReferenceData {
+
+    // data members
+    std::vector<uint32_t> BinIds;        // sorted
+    std::vector<uint32_t> BinChunkStart; // index into Chunks, one per bin (+ end marker)
+    BaiAlignmentChunkVector Chunks;
+    BaiLinearOffsetVector LinearOffsets;
+};
+
+// convenience typedef for the in-memory index of all references
+typedef std::vector<BaiReferenceData> BaiIndexData;
+
 // end BamStandardIndex data structures
 // -----------------------------------------------------------------------------
 
@@ -155,24 +169,22 @@ class BamStandardIndex : public BamIndex {
         void CalculateCandidateBins(const uint32_t& begin,
                                     const uint32_t& end,
                                     std::set<uint16_t>& candidateBins);
-        void CalculateCandidateOffsets(const BaiReferenceSummary& refSummary,
+        void CalculateCandidateOffsets(const BaiReferenceData& refData,
                                        const uint64_t& minOffset,
                                        std::set<uint16_t>& candidateBins,
                                        std::vector<int64_t>& offsets);
-        uint64_t CalculateMinOffset(const BaiReferenceSummary& refSummary, const uint32_t& begin);
+        uint64_t CalculateMinOffset(const BaiReferenceData& refData, const uint32_t& begin);
         void GetOffset(const BamRegion& region, int64_t& offset, bool* hasAlignmentsInRegion);
-        uint64_t LookupLinearOffset(const BaiReferenceSummary& refSummary, const int& index);
 
         // BAI summary (create/load) methods
         void ReserveForSummary(const int& numReferences);
         void SaveBinsSummary(const int& refId, const int& numBins);
         void SaveLinearOffsetsSummary(const int& refId, const int& numLinearOffsets);
-        void SkipBins(const int& numBins);
-        void SkipLinearOffsets(const int& numLinearOffsets);
-        void SummarizeBins(BaiReferenceSummary& refSummary);
+        void SummarizeBins(BaiReferenceSummary& refSummary, BaiReferenceData& refData);
         void SummarizeIndexFile(void);
-        void SummarizeLinearOffsets(BaiReferenceSummary& refSummary);
-        void SummarizeReference(BaiReferenceSummary& refSummary);
+        void SummarizeLinearOffsets(BaiReferenceSummary& refSummary, BaiReferenceData& refData);
+        void SummarizeReference(BaiReferenceSummary& refSummary, BaiReferenceData& refData);
+        void StoreReferenceData(const BaiReferenceEntry& refEntry);
 
         // BAI full index input methods
         void ReadBinID(uint32_t& binId);
@@ -199,6 +211,7 @@ class BamStandardIndex : public BamIndex {
     private:
         bool m_isBigEndian;
         BaiFileSummary m_indexFileSummary;
+        BaiIndexData m_indexData;
 
         // our input buffer
         unsigned int m_bufferLength;
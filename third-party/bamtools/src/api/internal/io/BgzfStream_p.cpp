@@ -2,7 +2,7 @@
 // BgzfStream_p.cpp (c) 2011 Derek Barnett
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 17 January 2012(DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Based on BGZF routines developed at the Broad Institute.
 // Provides the basic functionality for reading & writing BGZF files
@@ -25,6 +25,10 @@ using namespace BamTools::Internal;
 #include <sstream>
 using namespace std;
 
+// blocks read after each Seek() that go through the block cache; blocks
+// further on are from a sequential scan and are never revisited
+static const unsigned int BLOCK_CACHE_RUN = 4;
+
 // ---------------------------
 // BgzfStream implementation
 // ---------------------------
@@ -38,6 +42,11 @@ BgzfStream::BgzfStream(void)
   , m_device(0)
   , m_uncompressedBlock(Constants::BGZF_DEFAULT_BLOCK_SIZE)
   , m_compressedBlock(Constants::BGZF_MAX_BLOCK_SIZE)
+  , m_blockCacheSize(0)
+  , m_blockCacheUsed(0)
+  , m_blockCacheHits(0)
+  , m_blockCacheMisses(0)
+  , m_blocksSinceSeek(BLOCK_CACHE_RUN)
 { }
 
 // destructor
@@ -45,6 +54,39 @@ BgzfStream::~BgzfStream(void) {
     Close();
 }
 
+// stores the block just read (at blockAddress) in the block cache
+void BgzfStream::CacheBlock(const int64_t& blockAddress) {
+
+    ++m_blockCacheMisses;
+
+    // skip empty (EOF) blocks & blocks that would never fit
+    const size_t length = m_blockLength;
+    if ( length == 0 || length > m_blockCacheSize )
+        return;
+
+    // evict least recently used blocks until this one fits,
+    // keeping the last one evicted to reuse its storage
+    BlockCacheList spare;
+    while ( m_blockCacheUsed + length > m_blockCacheSize ) {
+        BlockCacheList::iterator last = --m_blockCache.end();
+        m_blockCacheUsed -= last->Data.size();
+        m_blockCacheIndex.erase(last->Address);
+        spare.clear();
+        spare.splice(spare.begin(), m_blockCache, last);
+    }
+    if ( spare.empty() )
+        spare.push_back(CachedBlock());
+    m_blockCache.splice(m_blockCache.begin(), spare);
+
+    // copy inflated data into the (now most recently used) entry
+    CachedBlock& block = m_blockCache.front();
+    block.Address     = blockAddress;
+    block.NextAddress = m_device->Tell();
+    block.Data.assign(m_uncompressedBlock.Buffer, m_uncompressedBlock.Buffer + length);
+    m_blockCacheIndex[blockAddress] = m_blockCache.begin();
+    m_blockCacheUsed += length;
+}
+
 // checks BGZF block header
 bool BgzfStream::CheckBlockHeader(char* header) {
     return (header[0] == Constants::GZIP_ID1 &&
@@ -57,6 +99,13 @@ bool BgzfStream::CheckBlockHeader(char* header) {
             BamTools::UnpackUnsignedShort(&header[14]) == Constants::BGZF_LEN );
 }
 
+// drops all cached blocks
+void BgzfStream::ClearBlockCache(void) {
+    m_blockCache.clear();
+    m_blockCacheIndex.clear();
+    m_blockCacheUsed = 0;
+}
+
 // closes BGZF file
 void BgzfStream::Close(void) {
 
@@ -76,6 +125,9 @@ void BgzfStream::Close(void) {
     delete m_device;
     m_device = 0;
 
+    // cached blocks belong to the old file
+    ClearBlockCache();
+
     // ensure our buffers are cleared out
     m_uncompressedBlock.Clear();
     m_compressedBlock.Clear();
@@ -227,6 +279,12 @@ void BgzfStream::FlushBlock(void) {
     }
 }
 
+// retrieves hit & miss counts for the inflated-block cache
+void BgzfStream::GetBlockCacheStats(uint64_t& hits, uint64_t& misses) const {
+    hits   = m_blockCacheHits;
+    misses = m_blockCacheMisses;
+}
+
 // decompresses the current block
 size_t BgzfStream::InflateBlock(const size_t& blockLength) {
 
@@ -334,6 +392,36 @@ size_t BgzfStream::Read(char* data, const size_t dataLength) {
     return numBytesRead;
 }
 
+// loads a cached block, returns false if it isn't in the cache
+bool BgzfStream::ReadCachedBlock(const int64_t& blockAddress) {
+
+    map<int64_t, BlockCacheList::iterator>::iterator indexIter = m_blockCacheIndex.find(blockAddress);
+    if ( indexIter == m_blockCacheIndex.end() )
+        return false;
+
+    // mark block as most recently used
+    BlockCacheList::iterator blockIter = indexIter->second;
+    m_blockCache.splice(m_blockCache.begin(), m_blockCache, blockIter);
+
+    // move device past the block, as if it had been read
+    if ( !m_device->Seek(blockIter->NextAddress) ) {
+        stringstream s("");
+        s << "unable to seek to position: " << blockIter->NextAddress;
+        throw BamException("BgzfStream::ReadCachedBlock", s.str());
+    }
+
+    // copy cached data into uncompressed buffer
+    memcpy(m_uncompressedBlock.Buffer, &blockIter->Data[0], blockIter->Data.size());
+
+    // update block data
+    if ( m_blockLength != 0 )
+        m_blockOffset = 0;
+    m_blockAddress = blockAddress;
+    m_blockLength  = blockIter->Data.size();
+    ++m_blockCacheHits;
+    return true;
+}
+
 // reads a BGZF block
 void BgzfStream::ReadBlock(void) {
 
@@ -342,6 +430,15 @@ void BgzfStream::ReadBlock(void) {
     // store block's starting address
     const int64_t blockAddress = m_device->Tell();
 
+    // use cached copy of block, if we have one (only just after a seek)
+    const bool useCache = ( m_blockCacheSize > 0 &&
+                            m_blocksSinceSeek < BLOCK_CACHE_RUN &&
+                            m_device->IsRandomAccess() );
+    if ( m_blocksSinceSeek < BLOCK_CACHE_RUN )
+        ++m_blocksSinceSeek;
+    if ( useCache && ReadCachedBlock(blockAddress) )
+        return;
+
     // read block header from file
     char header[Constants::BGZF_BLOCK_HEADER_LENGTH];
     int64_t numBytesRead = m_device->Read(header, Constants::BGZF_BLOCK_HEADER_LENGTH);
@@ -392,6 +489,10 @@ void BgzfStream::ReadBlock(void) {
         m_blockOffset = 0;
     m_blockAddress = blockAddress;
     m_blockLength  = newBlockLength;
+
+    // keep a copy for later visits
+    if ( useCache )
+        CacheBlock(blockAddress);
 }
 
 // seek to position in BGZF file
@@ -413,6 +514,7 @@ void BgzfStream::Seek(const int64_t& position) {
         m_blockLength  = 0;
         m_blockAddress = blockAddress;
         m_blockOffset  = blockOffset;
+        m_blocksSinceSeek = 0;
     }
     else {
         stringstream s("");
@@ -421,6 +523,13 @@ void BgzfStream::Seek(const int64_t& position) {
     }
 }
 
+// sets memory budget (bytes) for the inflated-block cache (0 disables)
+void BgzfStream::SetBlockCacheSize(const size_t& bytes) {
+    m_blockCacheSize = bytes;
+    if ( m_blockCacheUsed > m_blockCacheSize )
+        ClearBlockCache();
+}
+
 void BgzfStream::SetWriteCompressed(bool ok) {
     m_isWriteCompressed = ok;
 }
@@ -2,7 +2,7 @@
 // BgzfStream_p.h (c) 2011 Derek Barnett
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 17 January 2012(DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Based on BGZF routines developed at the Broad Institute.
 // Provides the basic functionality for reading & writing BGZF files
@@ -25,7 +25,10 @@
 #include "api/api_global.h"
 #include "api/BamAux.h"
 #include "api/IBamIODevice.h"
+#include <list>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace BamTools {
 namespace Internal {
@@ -41,6 +44,8 @@ class BgzfStream {
     public:
         // closes BGZF file
         void Close(void);
+        // retrieves hit & miss counts for the inflated-block cache
+        void GetBlockCacheStats(uint64_t& hits, uint64_t& misses) const;
         // returns true if BgzfStream open for IO
         bool IsOpen(void) const;
         // opens the BGZF file
@@ -49,6 +54,8 @@ class BgzfStream {
         size_t Read(char* data, const size_t dataLength);
         // seek to position in BGZF file
         void Seek(const int64_t& position);
+        // sets memory budget (bytes) for the inflated-block cache (0 disables)
+        void SetBlockCacheSize(const size_t& bytes);
         // sets IO device (closes previous, if any, but does not attempt to open)
         void SetIODevice(IBamIODevice* device);
         // enable/disable compressed output
@@ -60,12 +67,18 @@ class BgzfStream {
 
     // internal methods
     private:
+        // stores the block just read (at blockAddress) in the block cache
+        void CacheBlock(const int64_t& blockAddress);
+        // drops all cached blocks
+        void ClearBlockCache(void);
         // compresses the current block
         size_t DeflateBlock(int32_t blockLength);
         // flushes the data in the BGZF block
         void FlushBlock(void);
         // de-compresses the current block
         size_t InflateBlock(const size_t& blockLength);
+        // loads a cached block, returns false if it isn't in the cache
+        bool ReadCachedBlock(const int64_t& blockAddress);
         // reads a BGZF block
         void ReadBlock(void);
 
@@ -85,6 +98,25 @@ class BgzfStream {
 
         RaiiBuffer m_uncompressedBlock;
         RaiiBuffer m_compressedBlock;
+
+    // inflated-block cache, for readers that keep jumping back into blocks
+    // they have already read (e.g. many small SetRegion calls); only the
+    // first few blocks after each Seek() are cached
+    private:
+        struct CachedBlock {
+            int64_t Address;            // compressed file offset of block
+            int64_t NextAddress;        // compressed file offset of the block after it
+            std::vector<char> Data;     // inflated contents
+        };
+        typedef std::list<CachedBlock> BlockCacheList;
+
+        BlockCacheList m_blockCache;    // most recently used first
+        std::map<int64_t, BlockCacheList::iterator> m_blockCacheIndex;
+        size_t m_blockCacheSize;
+        size_t m_blockCacheUsed;
+        uint64_t m_blockCacheHits;
+        uint64_t m_blockCacheMisses;
+        unsigned int m_blocksSinceSeek;
 };
 
 } // namespace Internal
@@ -2,7 +2,7 @@
 // bamtools_pileup_engine.cpp (c) 2010 Derek Barnett, Erik Garrison
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 9 March 2012 (DB)
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides pileup at position functionality for various tools.
 // ***************************************************************************
@@ -10,6 +10,7 @@
 #include "utils/bamtools_pileup_engine.h"
 using namespace BamTools;
 
+#include <deque>
 #include <iostream>
 using namespace std;
 
@@ -21,8 +22,15 @@ struct PileupEngine::PileupEnginePrivate {
     // data members
     int CurrentId;
     int CurrentPosition;
-    vector<BamAlignment> CurrentAlignments;
     PileupPosition CurrentPileupData;
+
+    // active alignments live in a pool of recycled slots: a deque keeps
+    // their addresses stable, and re-assigning a freed slot reuses its
+    // string/vector storage, so a long scan settles at ~zero allocations
+    deque<BamAlignment> AlignmentPool;
+    vector<int> PoolEndPositions;      // cached GetEndPosition() per slot
+    vector<size_t> FreeSlots;
+    vector<size_t> CurrentAlignments;  // active slots, in input order
     
     bool IsFirstAlignment;
     vector<PileupVisitor*> Visitors;
@@ -41,6 +49,7 @@ struct PileupEngine::PileupEnginePrivate {
     
     // internal methods
     private:
+        void AddToPool(const BamAlignment& al);
         void ApplyVisitors(void);
         void ClearOldData(void);
         void CreatePileupData(void);
@@ -57,8 +66,7 @@ bool PileupEngine::PileupEnginePrivate::AddAlignment(const BamAlignment& al) {
         CurrentPosition = al.Position;
         
         // store first entry
-        CurrentAlignments.clear();
-        CurrentAlignments.push_back(al);
+        AddToPool(al);
         
         // set flag & return
         IsFirstAlignment = false;
@@ -70,7 +78,7 @@ bool PileupEngine::PileupEnginePrivate::AddAlignment(const BamAlignment& al) {
       
         // if same position, store and move on
         if ( al.Position == CurrentPosition )
-            CurrentAlignments.push_back(al);
+            AddToPool(al);
         
         // if less than CurrentPosition - sorting error => ABORT
         else if ( al.Position < CurrentPosition ) {
@@ -84,7 +92,7 @@ bool PileupEngine::PileupEnginePrivate::AddAlignment(const BamAlignment& al) {
                 ApplyVisitors();
                 ++CurrentPosition;
             }
-            CurrentAlignments.push_back(al);
+            AddToPool(al);
         }
     } 
 
@@ -104,8 +112,7 @@ bool PileupEngine::PileupEnginePrivate::AddAlignment(const BamAlignment& al) {
         }
         
         // store first entry on this new reference, update markers
-        CurrentAlignments.clear();
-        CurrentAlignments.push_back(al);
+        AddToPool(al);
         CurrentId = al.RefID;
         CurrentPosition = al.Position;
     }
@@ -113,6 +120,23 @@ bool PileupEngine::PileupEnginePrivate::AddAlignment(const BamAlignment& al) {
     return true;
 }
 
+void PileupEngine::PileupEnginePrivate::AddToPool(const BamAlignment& al) {
+
+    // reuse a free slot if we have one, otherwise grow the pool
+    size_t slot;
+    if ( !FreeSlots.empty() ) {
+        slot = FreeSlots.back();
+        FreeSlots.pop_back();
+        AlignmentPool[slot] = al;
+        PoolEndPositions[slot] = al.GetEndPosition();
+    } else {
+        slot = AlignmentPool.size();
+        AlignmentPool.push_back(al);
+        PoolEndPositions.push_back(al.GetEndPosition());
+    }
+    CurrentAlignments.push_back(slot);
+}
+
 void PileupEngine::PileupEnginePrivate::ApplyVisitors(void) {
   
     // parse CIGAR data in BamAlignments to build up current pileup data
@@ -137,25 +161,25 @@ void PileupEngine::PileupEnginePrivate::ClearOldData(void) {
     const size_t numAlignments = CurrentAlignments.size();
     while ( i < numAlignments ) {
 
-        // skip over alignment if its (1-based) endPosition is <= to (0-based) CurrentPosition
-        // i.e. this entry will not be saved upon vector resize
-        const int endPosition = CurrentAlignments[i].GetEndPosition();
-        if ( endPosition <= CurrentPosition ) {
+        // release slot if its (1-based) endPosition is <= to (0-based) CurrentPosition
+        const size_t slot = CurrentAlignments[i];
+        if ( PoolEndPositions[slot] <= CurrentPosition ) {
+            FreeSlots.push_back(slot);
             ++i;
             continue;
         }
 
         // otherwise alignment ends after CurrentPosition
-        // move it towards vector beginning, at index j
+        // move its slot number towards vector beginning, at index j
         if ( i != j )
-            CurrentAlignments[j] = CurrentAlignments[i];
+            CurrentAlignments[j] = slot;
 
         // increment our indices
         ++i;
         ++j;
     }
 
-    // 'squeeze' vector to size j, discarding all remaining alignments in the container
+    // 'squeeze' vector to size j, discarding all released slots
     CurrentAlignments.resize(j);
 }
 
@@ -170,10 +194,10 @@ void PileupEngine::PileupEnginePrivate::CreatePileupData(void) {
     CurrentPileupData.PileupAlignments.clear();
     
     // parse CIGAR data in remaining alignments 
-    vector<BamAlignment>::const_iterator alIter = CurrentAlignments.begin();
-    vector<BamAlignment>::const_iterator alEnd  = CurrentAlignments.end(); 
-    for ( ; alIter != alEnd; ++alIter )
-        ParseAlignmentCigar( (*alIter) );
+    vector<size_t>::const_iterator slotIter = CurrentAlignments.begin();
+    vector<size_t>::const_iterator slotEnd  = CurrentAlignments.end(); 
+    for ( ; slotIter != slotEnd; ++slotIter )
+        ParseAlignmentCigar( AlignmentPool[*slotIter] );
 }
 
 void PileupEngine::PileupEnginePrivate::Flush(void) {
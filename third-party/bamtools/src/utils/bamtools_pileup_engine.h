@@ -2,7 +2,7 @@
 // bamtools_pileup_engine.h (c) 2010 Derek Barnett, Erik Garrison
 // Marth Lab, Department of Biology, Boston College
 // ---------------------------------------------------------------------------
-// Last modified: 10 October 2011
+// Last modified: 19 October 2026
 // ---------------------------------------------------------------------------
 // Provides pileup at position functionality for various tools.
 // ***************************************************************************
@@ -19,10 +19,12 @@ namespace BamTools {
 
 // contains auxiliary data about a single BamAlignment
 // at current position considered
+// N.B. - Alignment refers to the engine's copy of the read, which is only
+//        valid for the duration of PileupVisitor::Visit()
 struct UTILS_EXPORT PileupAlignment {
   
     // data members
-    BamAlignment Alignment;
+    const BamAlignment& Alignment;
     int32_t PositionInAlignment;
     bool IsCurrentDeletion;
     bool IsNextDeletion;
@@ -4,24 +4,37 @@
 #include <vector>
 #include <string>
 #include <algorithm>
-#include <sys/stat.h>
+#include <array>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <memory>
 
 
 #include "boost/program_options.hpp"
 #include "api/BamReader.h"
 #include "utils/bamtools_pileup_engine.h"
-#include "utils/bamtools_fasta.h"
 
 #include "model.h"
 #include "parsers.h"
+#include "merged_reader.h"
+#include "shards.h"
+#include "region_mask.h"
+#include "dup_filter.h"
 
 using namespace std;
 using namespace BamTools;
 
+//Callable sites per sample and reference base. These run to the size of the
+//genome, far past what a ReadData slot holds
+typedef vector< array<uint64_t, 4> > DenomVector;
 
+//Contigs (or intervals) are cut into chunks of this many bases, which the
+//threads take in turn
+const uint64_t DENOM_CHUNK_SIZE = 1000000;
 
 
-bool include_sample(const ModelParams &params, const ReadDataVector fwd, const ReadDataVector rev,  const ReadDataVector site_data, int sindex, uint16_t ref_base, double pcut, bool central){
+bool include_sample(const ModelParams &params, const ReadDataVector& fwd, const ReadDataVector& rev,  const ReadDataVector& site_data, int sindex, uint16_t ref_base, double pcut, bool central){
     
     //Can't be included if you don't have 3fwd, 3rev so check that before we do
     //any number crunching    
@@ -60,11 +73,11 @@ void call_ancestor(const ModelParams &params, int ref_allele, const ReadData &d)
     }
     else{
     	DiploidProbs genotypes = DiploidSequencing(params, ref_allele, d);
-        Eigen::Array33d::Index idx;
+        DiploidProbs::Index idx;
         //std::cerr << genotypes.maxCoeff() << std::endl;
         genotypes.maxCoeff(&idx);
-        result[0] = idx / 4;
-        result[1] = idx % 4;
+        result[0] = GENOTYPE_ALLELES[idx][0];
+        result[1] = GENOTYPE_ALLELES[idx][1];
     }
     std::cerr << result[0] << '\t' << result[1] << '\t';
 }
@@ -78,38 +91,65 @@ class VariantVisitor : public PileupVisitor{
     public:
         VariantVisitor(const RefVector& bam_references, 
                        const SamHeader& header,
-                       const Fasta& idx_ref,
-                       const SampleMap& samples, 
+                       const FastaReference& idx_ref,
+                       const SampleSet& samples, 
                        int nsamples,
                        BamAlignment& ali, 
                        int qual_cut,
-                       int mapping_cut,
-                       ReadDataVector &denoms,
+                       DenomVector &denoms,
                        ModelParams& params):
 
-            PileupVisitor(), m_idx_ref(idx_ref), m_bam_ref(bam_references), 
+            PileupVisitor(), m_idx_ref(idx_ref), m_ref_id(-1), m_bam_ref(bam_references), 
                              m_header(header), m_samples(samples),m_nsamp(nsamples), 
                              m_qual_cut(qual_cut), m_ali(ali), 
                              m_denoms(denoms),
-                             m_mapping_cut(mapping_cut), m_params(params)
+                             m_params(params), m_start(0), m_end(UINT64_MAX),
+                             m_mask(nullptr)
                               { }
 
         ~VariantVisitor(void) { }
     public:
+         //Only count sites in [start, end), so reads that overlap the next
+         //chunk don't count twice
+         void set_region(uint64_t start, uint64_t end){
+             m_start = start;
+             m_end = end;
+         }
+
+         //Leave out sites masked by --exclude
+         void set_mask(const RegionMask* mask){
+             m_mask = mask;
+         }
+
          void Visit(const PileupPosition& pileupData) {
              uint64_t pos  = pileupData.Position;
+             if(pos < m_start || pos >= m_end){
+                 return;
+             }
+             if(m_mask && m_mask->masked(pileupData.RefId, pos)){
+                 return;
+             }
              uint32_t dist_to_end  = ( (pos < 500) ? pos :  (m_bam_ref[pileupData.RefId].RefLength - pos));
              bool central = dist_to_end > 500;
-             m_idx_ref.GetBase(pileupData.RefId, pos, current_base);
+             if(pileupData.RefId != m_ref_id){
+                 m_ref_id = pileupData.RefId;
+                 m_ref_seq = m_idx_ref.sequence(m_bam_ref[m_ref_id].RefName);
+                 if(!m_ref_seq.data){
+                     cerr << "Warning: " << m_bam_ref[m_ref_id].RefName << " is not in the reference" << endl;
+                 }
+             }
+             current_base = (pos < m_ref_seq.length) ? m_ref_seq[pos] : 'N';
              ReadDataVector fwd_calls (m_samples.size(), ReadData{{ 0,0,0,0 }}); 
              ReadDataVector rev_calls (m_samples.size(), ReadData{{ 0,0,0,0 }});
              for(auto it = begin(pileupData.PileupAlignments);
                       it !=  end(pileupData.PileupAlignments); 
                       ++it){
-                 if( include_site(*it, m_mapping_cut, m_qual_cut) ){
-                    it->Alignment.GetTag("RG", tag_id);
-                    uint32_t sindex = m_samples[tag_id]; //TODO check samples existed! 
-                    uint16_t bindex  = base_index(it->Alignment.QueryBases[it->PositionInAlignment]);
+                 if( include_site(*it, m_qual_cut) ){
+                    int sindex = m_samples.index(it->Alignment);
+                    if(sindex < 0){
+                        continue;
+                    }
+                    uint16_t bindex  = base_index(query_base(it->Alignment, it->PositionInAlignment));
                     if (bindex < 4 ){
                         if(it->Alignment.IsReverseStrand() ){
                             fwd_calls[sindex].reads[bindex] += 1;
@@ -133,7 +173,7 @@ class VariantVisitor : public PileupVisitor{
 
                 for(size_t i  = 1; i < m_samples.size(); i++){
                     if( include_sample(m_params, fwd_calls, rev_calls, all_calls, i, ref_base_idx, 0.1, central) ){
-                        m_denoms[i].reads[ref_base_idx] += 1;
+                        m_denoms[i][ref_base_idx] += 1;
                     }
                 }
             }
@@ -162,17 +202,20 @@ class VariantVisitor : public PileupVisitor{
     private:
         RefVector m_bam_ref;
         SamHeader m_header;
-        Fasta m_idx_ref; 
-        SampleMap m_samples;
+        const FastaReference& m_idx_ref; 
+        int m_ref_id;
+        SequenceView m_ref_seq;
+        SampleSet m_samples;
         int m_nsamp;
         BamAlignment& m_ali;
         int m_qual_cut;
-        int m_mapping_cut;
         char current_base;
-        string tag_id;
         uint64_t chr_index;
-        ReadDataVector& m_denoms;
+        DenomVector& m_denoms;
         ModelParams m_params;
+        uint64_t m_start;
+        uint64_t m_end;
+        const RegionMask* m_mask;
 };
 
 
@@ -185,8 +228,9 @@ int main(int argc, char** argv){
     po::options_description cmd("Command line options");
     cmd.add_options()
         ("help,h", "Print a help message")
-        ("bam,b", po::value<string>()->required(), "Path to BAM file")
-        ("bam-index,x", po::value<string>()->default_value(""), "Path to BAM index, (defalult is <bam_path>.bai")
+        ("bam,b", po::value<vector<string> >()->required(), "Path to BAM file (repeat for one BAM per sample/line)")
+        ("bam-index,x", po::value<vector<string> >(), "Path to BAM index, one per BAM (defalult is <bam_path>.bai")
+        ("sample-per-file", "Treat each BAM as one sample, ignoring read groups")
         ("reference,r", po::value<string>(&ref_file)->required(),  "Path to reference genome")
 //       ("ancestor,a", po::value<string>(&anc_tag), "Ancestor RG sample ID")
 //        ("sample-name,s", po::value<vector <string> >()->required(), "Sample tags")
@@ -195,8 +239,15 @@ int main(int argc, char** argv){
         
         ("mapping-qual,m", po::value<int>()->default_value(13), 
                     "Mapping quality cuttoff")
+        ("threads,t", po::value<int>()->default_value(1),
+                    "Threads, each with its own BAM readers")
      
-        ("intervals,i", po::value<string>(), "Path to bed file");
+        ("intervals,i", po::value<string>(), "Path to bed file")
+        ("exclude", po::value<vector<string> >(), "BED file of regions to leave out (repeat for more)")
+        ("remove-duplicates", "Drop duplicate reads as they're read in, for BAMs that haven't been through MarkDuplicates")
+        ("block-cache", po::value<int>()->default_value(BLOCK_CACHE_MB),
+                    "MB of inflated BAM blocks to keep for chunks that start in blocks already read (0 for none)")
+        ("out,o", po::value<string>(), "Write the counts here (and, with -i, mark it done for accuMUlate merge) instead of stdout");
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, cmd), vm);
@@ -215,96 +266,180 @@ int main(int argc, char** argv){
     };
 
     vm.notify();
-    string bam_path = vm["bam"].as<string>();
-    string index_path = vm["bam-index"].as<string>();
-    if(index_path == ""){
-        index_path = bam_path + ".bai";
-    }   
+    vector<string> bam_paths = vm["bam"].as<vector<string> >();
+    vector<string> index_paths;
+    if(vm.count("bam-index")){
+        index_paths = vm["bam-index"].as<vector<string> >();
+    }
 
 
-    BamReader experiment; 
-    experiment.Open(bam_path);
-    experiment.OpenIndex(index_path);
+    MergedBamReader experiment; 
+    if(!experiment.Open(bam_paths, index_paths)){
+        return 1;
+    }
     RefVector references = experiment.GetReferenceData(); 
     SamHeader header = experiment.GetHeader();
 
     
-    //Fasta reference
-    Fasta reference_genome; // BamTools::Fasta
-    struct stat file_info;
-    string faidx_path = ref_file + ".fai";
-    if (stat(faidx_path.c_str(), &file_info) != 0){
-        reference_genome.CreateIndex(faidx_path);
+    //Fasta reference, mmaped (and indexed if there's no .fai yet)
+    FastaReference reference_genome (ref_file);
+    if(!reference_genome.good()){
+        return 1;
     }
-    reference_genome.Open(ref_file, faidx_path);
-
-    // Map readgroups to samples
-    // TODO: this presumes first sample is ancestor. True for our data, not for
-    // others.
-    // First map all sample names to an index for ReadDataVectors
-    SampleMap name_map;
-    uint16_t sindex = 0;
-    for(auto it = header.ReadGroups.Begin(); it!= header.ReadGroups.End(); it++){
-        if(it->HasSample()){
-            auto s  = name_map.find(it->Sample);
-            if( s == name_map.end()){ // not in there yet
-                name_map[it->Sample] = sindex;
-                sindex += 1;
-            }
-        }
-    }
-    // And now, go back over the read groups to map RG:sample index
-    SampleMap samples;
-    for(auto it = header.ReadGroups.Begin(); it!= header.ReadGroups.End(); it++){
-        if(it->HasSample()){
-            samples[it->ID] = name_map[it->Sample];  
-        }
+
+    // Map readgroups (or whole files) to samples. The first sample is taken
+    // to be the ancestor, so it needs to be in the first BAM
+    SampleSet samples;
+    if(!experiment.samples(vm.count("sample-per-file"), samples)){
+        return 1;
     }
+    uint16_t sindex = samples.size();
+    int mapping_cut = vm["mapping-qual"].as<int>();
 
-    PileupEngine pileup;
-    BamAlignment ali;
-
-    ReadDataVector denoms (sindex, {0,0,0,0} );
-
-    VariantVisitor *v = new VariantVisitor(
-            references,
-            header,
-            reference_genome, 
-//            vm["sample-name"].as<vector< string> >(),
-            samples,
-            sindex,
-            ali, 
-            vm["qual"].as<int>(), 
-            vm["mapping-qual"].as<int>(),
-            denoms,
-            params            
-        );
-    pileup.AddVisitor(v);
-   
+    vector<BedInterval> regions;
     if (vm.count("intervals")){
         BedFile bed (vm["intervals"].as<string>());
         BedInterval region;
         while(bed.get_interval(region) == 0){
-            int ref_id = experiment.GetReferenceID(region.chr);
-            experiment.SetRegion(ref_id, region.start, ref_id, region.end);
-            while( experiment.GetNextAlignment(ali) ){
-                pileup.AddAlignment(ali);
-            }
+            regions.push_back(region);
         }
     }
     else{
-        while( experiment.GetNextAlignment(ali)){
-            pileup.AddAlignment(ali);
-        }  
+        for(auto& r: references){
+            regions.push_back(BedInterval{ r.RefName, 0, static_cast<uint64_t>(r.RefLength) });
+        }
+    }
+    //Long masked runs are cut out of the chunks, so they're never read
+    unique_ptr<RegionMask> mask;
+    if(vm.count("exclude")){
+        mask.reset(new RegionMask(references));
+        for(auto& path: vm["exclude"].as<vector<string> >()){
+            if(!mask->add_bed(path)){
+                return 1;
+            }
+        }
+        cerr << "exclude: " << mask->masked_bases() << " bases masked" << endl;
+    }
+    vector<BedInterval> chunks;
+    for(auto& r: regions){
+        for(uint64_t start = r.start; start < r.end; start += DENOM_CHUNK_SIZE){
+            BedInterval chunk{ r.chr, start, min(r.end, start + DENOM_CHUNK_SIZE) };
+            if(!mask){
+                chunks.push_back(chunk);
+                continue;
+            }
+            for(auto& part: mask->unmasked(chunk, MASK_JUMP_MIN)){
+                chunks.push_back(part);
+            }
+        }
     }
-    pileup.Flush();
+
+    //Every thread has its own readers, pileup and counters; the counters are
+    //summed at the end
+    int nthreads = max(1, vm["threads"].as<int>());
+    vector<DenomVector> denoms(nthreads, DenomVector(sindex, array<uint64_t, 4>{{0, 0, 0, 0}}));
+    atomic<size_t> next_chunk(0);
+    atomic<bool> failed(false);
+    size_t block_cache = static_cast<size_t>(max(0, vm["block-cache"].as<int>())) << 20;
+    atomic<uint64_t> cache_hits(0), cache_misses(0);
+    auto work = [&](int t){
+        MergedBamReader reader;
+        SampleSet thread_samples;
+        if(!reader.Open(bam_paths, index_paths) ||
+           !reader.samples(vm.count("sample-per-file"), thread_samples)){
+            failed = true;
+            return;
+        }
+        reader.SetBlockCache(block_cache / nthreads);
+        BamAlignment ali;
+        VariantVisitor v(
+                references,
+                header,
+                reference_genome, 
+                thread_samples,
+                sindex,
+                ali, 
+                vm["qual"].as<int>(), 
+                denoms[t],
+                params            
+            );
+        v.set_mask(mask.get());
+        unique_ptr<DuplicateFilter> dups;
+        if(vm.count("remove-duplicates")){
+            dups.reset(new DuplicateFilter(thread_samples));
+        }
+        for(size_t c = next_chunk++; c < chunks.size(); c = next_chunk++){
+            const BedInterval& chunk = chunks[c];
+            PileupEngine pileup;
+            pileup.AddVisitor(&v);
+            auto add = [&](const BamAlignment& read){
+                pileup.AddAlignment(read);
+            };
+            v.set_region(chunk.start, chunk.end);
+            int ref_id = reader.GetReferenceID(chunk.chr);
+            reader.SetRegion(ref_id, chunk.start, ref_id, chunk.end);
+            while( reader.GetNextAlignmentCore(ali) ){
+                if( include_read(ali, mapping_cut) ){
+                    if(dups){
+                        dups->add(ali, add);
+                    }
+                    else{
+                        pileup.AddAlignment(ali);
+                    }
+                }
+            }
+            if(dups){
+                dups->flush(add);
+            }
+            pileup.Flush();
+        }
+        uint64_t hits, misses;
+        reader.BlockCacheStats(hits, misses);
+        cache_hits += hits;
+        cache_misses += misses;
+    };
+    vector<thread> threads;
+    for(int t = 1; t < nthreads; t++){
+        threads.push_back(thread(work, t));
+    }
+    work(0);
+    for(auto& t: threads){
+        t.join();
+    }
+    if(failed){
+        return 1;
+    }
+    if(cache_hits + cache_misses > 0){
+        cerr << "block-cache: " << cache_hits << " of " << cache_hits + cache_misses
+             << " blocks reused" << endl;
+    }
+    ofstream out_file;
+    if(vm.count("out")){
+        out_file.open(vm["out"].as<string>());
+        if(!out_file){
+            cerr << "Error: can't write to " << vm["out"].as<string>() << endl;
+            return 1;
+        }
+    }
+    ostream& out = vm.count("out") ? out_file : cout;
     for(size_t i = 0; i < sindex; i++){
         for( size_t j = 0; j < 4; j++){
-            cout << denoms[i].reads[j] << '\t'; 
+            uint64_t total = 0;
+            for(auto& d: denoms){
+                total += d[i][j];
+            }
+            out << total << '\t'; 
+        }
+    }
+    out << endl;
+    if(vm.count("out")){
+        out_file.close();
+        if(!out_file){
+            cerr << "Error: couldn't write all of " << vm["out"].as<string>() << endl;
+            return 1;
         }
+        write_done_marker(vm["out"].as<string>(),
+                          vm.count("intervals") ? regions : vector<BedInterval>());
     }
-    cout << endl;
     return 0;
 }
-
-
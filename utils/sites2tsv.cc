@@ -0,0 +1,57 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "boost/program_options.hpp"
+
+#include "parsers.h"
+#include "site_file.h"
+
+using namespace std;
+
+// Converts the binary site output of accuMUlate (--out-format binary) back
+// to the usual tab-separated results
+
+int main(int argc, char* argv[]){
+    namespace po = boost::program_options;
+    po::options_description cmd("Command line args");
+    cmd.add_options()
+        ("help,h", "Print a help message")
+        ("input,i", po::value<string>()->required(), "Path to binary results file")
+        ("region,r", po::value<string>(), "Only convert sites in region (chr or chr:start-end)")
+        ("out,o", po::value<string>(), "Out file name (default is stdout)");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, cmd), vm);
+    if (vm.count("help")){
+        cout << cmd << endl;
+        return 0;
+    }
+    vm.notify();
+
+    SiteReader sites(vm["input"].as<string>());
+    if(!sites.good()){
+        return 1;
+    }
+    if(vm.count("region")){
+        BedInterval region;
+        if(!parse_region(vm["region"].as<string>(), region)){
+            cerr << "Error: can't parse region " << vm["region"].as<string>() << endl;
+            return 1;
+        }
+        sites.set_region(region.chr, region.start, region.end);
+    }
+
+    ofstream out_file;
+    ostream* out = &cout;
+    if(vm.count("out")){
+        out_file.open(vm["out"].as<string>());
+        out = &out_file;
+    }
+
+    SiteRecord site;
+    while(sites.next(site)){
+        *out << site_to_tsv(site) << '\n';
+    }
+    return 0;
+}
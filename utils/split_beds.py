@@ -5,6 +5,11 @@ Usage
 
 split_beds [bam] [# of files to split into] [directory to write bed files]
 
+Intervals are 0-based and half-open, like all bed files, so together they
+cover the genome exactly once. manifest.txt in the same directory lists each
+bed file with the outputs `accuMUlate merge` will expect (interval_N.tsv from
+accuMUlate -o, interval_N.denom from denom -o).
+
 requires samtools to be on $PATH... everyone has samtools right?
 
 """
@@ -21,7 +26,7 @@ class Chromosome(object):
         self.length = length
         self.end = end
 
-    def make_bed_line(self, bed_start=1, bed_end=None):
+    def make_bed_line(self, bed_start=0, bed_end=None):
         if not bed_end:
             bed_end = self.length
         return("{0}\t{1}\t{2}\n".format(self.name, bed_start, bed_end))
@@ -51,7 +56,7 @@ def main():
     genome_len = genome[-1].end
     bed_ends = collections.deque(range(step, genome_len, step) + [genome_len, None])
 
-    start = 1
+    start = 0
     chr_idx = 0
     e = bed_ends.popleft()
     fcounter = 0
@@ -63,15 +68,19 @@ def main():
                 if e > genome[chr_idx].end:
                     out.write(genome[chr_idx].make_bed_line(bed_start=start))
                     chr_idx += 1
-                    start =  1
+                    start =  0
                 else:
                     offset = e - (genome[chr_idx].end - genome[chr_idx].length)
                     out.write(genome[chr_idx].make_bed_line(bed_start = start,
                         bed_end = offset))
-                    start = offset + 1
+                    start = offset
                     e = bed_ends.popleft()
                     break
 
+    with open("{0}/manifest.txt".format(out_dir), "w") as manifest:
+        for i in range(1, fcounter + 1):
+            manifest.write("interval_{0}.bed\tinterval_{0}.tsv\tinterval_{0}.denom\n".format(i))
+
     print("wrote {0} bed files for a total of {1} bases".format(fcounter, genome_len) )
     return 0
 
@@ -0,0 +1,61 @@
+#ifndef work_queue_H
+#define work_queue_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+//Bounded FIFO for handing batches between threads. push() blocks while the
+//queue is full, so a fast stage can't run too far ahead of a slow one. Once
+//close() is called pop() drains what's left then returns false.
+template<typename T>
+class WorkQueue{
+    public:
+        WorkQueue(size_t capacity): m_capacity(capacity), m_closed(false) { }
+
+        bool push(T item){
+            unique_lock<mutex> l(m_lock);
+            m_not_full.wait(l, [&]{ return m_closed || m_items.size() < m_capacity; });
+            if(m_closed){
+                return false;
+            }
+            m_items.push_back(move(item));
+            l.unlock();
+            m_not_empty.notify_one();
+            return true;
+        }
+
+        bool pop(T& item){
+            unique_lock<mutex> l(m_lock);
+            m_not_empty.wait(l, [&]{ return m_closed || !m_items.empty(); });
+            if(m_items.empty()){
+                return false;
+            }
+            item = move(m_items.front());
+            m_items.pop_front();
+            l.unlock();
+            m_not_full.notify_one();
+            return true;
+        }
+
+        void close(){
+            {
+                lock_guard<mutex> l(m_lock);
+                m_closed = true;
+            }
+            m_not_full.notify_all();
+            m_not_empty.notify_all();
+        }
+
+    private:
+        size_t m_capacity;
+        bool m_closed;
+        deque<T> m_items;
+        mutex m_lock;
+        condition_variable m_not_full;
+        condition_variable m_not_empty;
+};
+
+#endif